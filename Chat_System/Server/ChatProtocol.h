@@ -0,0 +1,377 @@
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+namespace CHAT_SYSTEM {
+
+// Wire protocol schema shared by the server and the client library.
+//
+// A frame is COMMAND|field|field|... terminated by FRAME_END. The last field
+// of a message keeps any '|' that follows, so it may carry free text or a
+// '|'-separated list. CHAT_MESSAGES is the only description of the messages:
+// the opcodes, the command names, a struct with the named fields of each
+// message, the field counts and the opcode lookup table are all generated
+// from it.
+//
+//   X(Struct, COMMAND, required fields, field names...)
+//
+// Fields after the required ones may be left out, by the sender or on the
+// wire. At most FRAME_MAX_FIELDS fields per message. An ERROR about a
+// SEND_MSG names its recipient and seq, so that the sender can tell which
+// message failed.
+#define CHAT_MESSAGES(X) \
+    /* Registration and sessions */ \
+    X(Register,       REGISTER,         1, clientId) \
+    X(Registered,     REGISTERED,       1, clientId) \
+    X(Session,        SESSION,          1, resumeToken) \
+    X(SessionAck,     SESSION_ACK,      1, framesRead) \
+    X(Resume,         RESUME,           3, clientId, token, framesRead) \
+    X(Resumed,        RESUMED,          2, clientId, framesRead) \
+    X(ResumeFailed,   RESUME_FAILED,    1, reason) \
+    X(Disconnect,     DISCONNECT,       1, clientId) \
+    /* Messages and receipts */ \
+    X(SendMsg,        SEND_MSG,         4, fromId, toId, seq, message) \
+    X(Message,        MESSAGE,          3, fromId, seq, message) \
+    X(Result,         RESULT,           3, fromId, toId, status) \
+    X(ResultAck,      RESULT_ACK,       2, fromId, status) \
+    X(ResultBatch,    RESULT_BATCH,     5, fromId, toId, firstSeq, lastSeq, status) \
+    X(ResultAckBatch, RESULT_ACK_BATCH, 4, fromId, firstSeq, lastSeq, status) \
+    X(Error,          ERROR,            1, text, toId, seq) \
+    /* Presence */ \
+    X(ClientList,     CLIENT_LIST,      0, entries) \
+    X(GetListId,      GETLISTID,        0, offset, limit, prefix) \
+    X(ClientListPage, CLIENT_LIST_PAGE, 3, version, offset, total, entries) \
+    X(Subscribe,      SUBSCRIBE,        0, clientIds) \
+    X(Unsubscribe,    UNSUBSCRIBE,      0, clientIds) \
+    X(Presence,       PRESENCE,         0, entries) \
+    /* Links between cluster nodes */ \
+    X(NodeHello,      NODE_HELLO,       2, nodeId, clusterKey) \
+    X(NodePresence,   NODE_PRESENCE,    1, nodeId, entries) \
+    X(NodeDeliver,    NODE_DELIVER,     3, clientId, lane, frame)
+
+static const size_t FRAME_MAX_FIELDS = 5;
+
+// Every frame on the wire is terminated by this character
+static const char FRAME_END = '\n';
+
+// Longest frame either side reads: a peer that sends more without FRAME_END
+// is dropped
+static const size_t FRAME_MAX_BYTES = 4 * 1024 * 1024;
+
+// Each side keeps the frames it wrote until the peer acknowledges them with
+// SESSION_ACK (sent every SESSION_ACK_FRAMES frames read), up to this many
+// bytes, and resends them after a reconnect. Frames are numbered across the
+// whole session: RESUME and RESUMED tell the other side how many frames were
+// read, and it writes the rest again under the same numbers. Nothing but the
+// RESUME is written before the RESUMED or RESUME_FAILED answer.
+static const size_t RESUME_LOG_BYTES = 1024 * 1024;
+static const unsigned long long SESSION_ACK_FRAMES = 64;
+
+// Non-owning view of part of a frame (std::string_view is C++17)
+class StringView {
+public:
+    static const size_t npos = static_cast<size_t>(-1);
+
+    StringView() : ptr(""), len(0) {}
+    StringView(const char* text) : ptr(text), len(strlen(text)) {}
+    StringView(const char* text, size_t length) : ptr(text), len(length) {}
+    StringView(const std::string& text) : ptr(text.data()), len(text.length()) {}
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    char operator[](size_t i) const { return ptr[i]; }
+
+    size_t find(char c, size_t from = 0) const {
+        if (from >= len) {
+            return npos;
+        }
+        const void* found = memchr(ptr + from, c, len - from);
+        return found ? static_cast<const char*>(found) - ptr : npos;
+    }
+
+    StringView substr(size_t pos, size_t count = npos) const {
+        if (pos > len) {
+            pos = len;
+        }
+        return StringView(ptr + pos, count < len - pos ? count : len - pos);
+    }
+
+    std::string str() const {
+        return std::string(ptr, len);
+    }
+
+    // Leading decimal digits, like strtoull ("12:abc" is 12)
+    unsigned long long toNumber() const {
+        unsigned long long value = 0;
+        for (size_t i = 0; i < len && ptr[i] >= '0' && ptr[i] <= '9'; ++i) {
+            value = value * 10 + (ptr[i] - '0');
+        }
+        return value;
+    }
+
+    friend bool operator==(StringView a, StringView b) {
+        return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+    }
+
+    friend bool operator!=(StringView a, StringView b) {
+        return !(a == b);
+    }
+
+private:
+    const char* ptr;
+    size_t len;
+};
+
+// Walks a '|'-separated list field: for (FieldIterator it(list); it.next(item);)
+class FieldIterator {
+public:
+    explicit FieldIterator(StringView list) : rest(list), done(list.empty()) {}
+
+    bool next(StringView& item) {
+        if (done) {
+            return false;
+        }
+        size_t bar = rest.find('|');
+        item = rest.substr(0, bar);
+        done = (bar == StringView::npos);
+        rest = rest.substr(bar + 1);
+        return true;
+    }
+
+private:
+    StringView rest;
+    bool done;
+};
+
+// A field may hold anything but FRAME_END, which would end the frame early
+inline bool isValidField(StringView field) {
+    return field.find(FRAME_END) == StringView::npos;
+}
+
+// Client ids also appear inside list fields and "id:STATUS" entries
+inline bool isValidClientId(StringView id) {
+    return !id.empty() && isValidField(id) && id.find('|') == StringView::npos &&
+           id.find(':') == StringView::npos;
+}
+
+// Opcodes: OP_REGISTER, OP_REGISTERED, ...
+#define CHAT_OPCODE(Name, COMMAND, required, ...) OP_##COMMAND,
+enum Opcode {
+    CHAT_MESSAGES(CHAT_OPCODE)
+    OP_COUNT,
+    OP_UNKNOWN = OP_COUNT
+};
+#undef CHAT_OPCODE
+
+#define CHAT_COMMAND_NAME(Name, COMMAND, required, ...) #COMMAND,
+static constexpr const char* const OPCODE_NAMES[OP_COUNT] = { CHAT_MESSAGES(CHAT_COMMAND_NAME) };
+#undef CHAT_COMMAND_NAME
+
+inline const char* opcodeName(Opcode opcode) {
+    return opcode < OP_COUNT ? OPCODE_NAMES[opcode] : "";
+}
+
+// Message structs: Wire::SendMsg has StringView fromId, toId, seq, message
+#define CHAT_COUNT_FIELDS(...) CHAT_COUNT_FIELDS_(__VA_ARGS__, 5, 4, 3, 2, 1, 0)
+#define CHAT_COUNT_FIELDS_(_1, _2, _3, _4, _5, count, ...) count
+#define CHAT_CONCAT(a, b) CHAT_CONCAT_(a, b)
+#define CHAT_CONCAT_(a, b) a##b
+#define CHAT_BIND_1(f, a) a = f[0];
+#define CHAT_BIND_2(f, a, b) a = f[0]; b = f[1];
+#define CHAT_BIND_3(f, a, b, c) a = f[0]; b = f[1]; c = f[2];
+#define CHAT_BIND_4(f, a, b, c, d) a = f[0]; b = f[1]; c = f[2]; d = f[3];
+#define CHAT_BIND_5(f, a, b, c, d, e) a = f[0]; b = f[1]; c = f[2]; d = f[3]; e = f[4];
+
+#define CHAT_MESSAGE_STRUCT(Name, COMMAND, required, ...) \
+    struct Name { \
+        static const Opcode OPCODE = OP_##COMMAND; \
+        static const size_t REQUIRED = required; \
+        static const size_t FIELDS = CHAT_COUNT_FIELDS(__VA_ARGS__); \
+        static_assert(REQUIRED <= FIELDS && FIELDS <= FRAME_MAX_FIELDS, #COMMAND " has too many fields"); \
+        StringView __VA_ARGS__; \
+        void bind(const StringView* f) { CHAT_CONCAT(CHAT_BIND_, CHAT_COUNT_FIELDS(__VA_ARGS__))(f, __VA_ARGS__) } \
+    };
+
+namespace Wire {
+CHAT_MESSAGES(CHAT_MESSAGE_STRUCT)
+}
+
+#define CHAT_FIELD_COUNT(Name, COMMAND, required, ...) Wire::Name::FIELDS,
+static const unsigned char OPCODE_FIELDS[OP_COUNT] = { CHAT_MESSAGES(CHAT_FIELD_COUNT) };
+#undef CHAT_FIELD_COUNT
+
+#define CHAT_REQUIRED_COUNT(Name, COMMAND, required, ...) Wire::Name::REQUIRED,
+static const unsigned char OPCODE_REQUIRED[OP_COUNT] = { CHAT_MESSAGES(CHAT_REQUIRED_COUNT) };
+#undef CHAT_REQUIRED_COUNT
+
+#undef CHAT_MESSAGE_STRUCT
+#undef CHAT_BIND_1
+#undef CHAT_BIND_2
+#undef CHAT_BIND_3
+#undef CHAT_BIND_4
+#undef CHAT_BIND_5
+#undef CHAT_CONCAT_
+#undef CHAT_CONCAT
+#undef CHAT_COUNT_FIELDS_
+#undef CHAT_COUNT_FIELDS
+
+// Perfect hash of the command names: the top OPCODE_SLOT_BITS of a seeded
+// FNV-1a pick the slot. The seed is checked at compile time; if a new
+// command collides, pick another seed that passes.
+static const uint32_t OPCODE_HASH_SEED = 2166136303u;
+static const unsigned OPCODE_SLOT_BITS = 6;
+static const size_t OPCODE_SLOTS = 1 << OPCODE_SLOT_BITS;
+
+constexpr uint32_t opcodeHash(const char* text, size_t length, uint32_t hash = OPCODE_HASH_SEED) {
+    return length == 0 ? hash : opcodeHash(text + 1, length - 1, (hash ^ static_cast<unsigned char>(*text)) * 16777619u);
+}
+
+constexpr size_t nameLength(const char* text) {
+    return *text ? 1 + nameLength(text + 1) : 0;
+}
+
+constexpr size_t opcodeSlot(size_t opcode) {
+    return opcodeHash(OPCODE_NAMES[opcode], nameLength(OPCODE_NAMES[opcode])) >> (32 - OPCODE_SLOT_BITS);
+}
+
+constexpr bool slotUnique(size_t opcode, size_t other = 0) {
+    return other == OP_COUNT ||
+           ((other == opcode || opcodeSlot(other) != opcodeSlot(opcode)) && slotUnique(opcode, other + 1));
+}
+
+constexpr bool slotsUnique(size_t opcode = 0) {
+    return opcode == OP_COUNT || (slotUnique(opcode) && slotsUnique(opcode + 1));
+}
+
+static_assert(slotsUnique(), "command names collide in the opcode table: change OPCODE_HASH_SEED");
+
+constexpr unsigned char slotOpcode(size_t slot, size_t opcode = 0) {
+    return opcode == OP_COUNT ? static_cast<size_t>(OP_UNKNOWN)
+         : opcodeSlot(opcode) == slot ? opcode : slotOpcode(slot, opcode + 1);
+}
+
+#define CHAT_SLOTS_4(s) slotOpcode(s), slotOpcode(s + 1), slotOpcode(s + 2), slotOpcode(s + 3)
+#define CHAT_SLOTS_16(s) CHAT_SLOTS_4(s), CHAT_SLOTS_4(s + 4), CHAT_SLOTS_4(s + 8), CHAT_SLOTS_4(s + 12)
+static constexpr unsigned char OPCODE_TABLE[OPCODE_SLOTS] = {
+    CHAT_SLOTS_16(0), CHAT_SLOTS_16(16), CHAT_SLOTS_16(32), CHAT_SLOTS_16(48)
+};
+#undef CHAT_SLOTS_16
+#undef CHAT_SLOTS_4
+
+// One table probe and one compare, OP_UNKNOWN for anything else
+inline Opcode lookupOpcode(StringView command) {
+    Opcode opcode = static_cast<Opcode>(OPCODE_TABLE[opcodeHash(command.data(), command.size()) >> (32 - OPCODE_SLOT_BITS)]);
+    return (opcode != OP_UNKNOWN && command == OPCODE_NAMES[opcode]) ? opcode : OP_UNKNOWN;
+}
+
+// A frame split into views of its fields, without copying
+struct Frame {
+    Opcode opcode;
+    size_t fieldCount;  // fields present on the wire
+    StringView fields[FRAME_MAX_FIELDS];
+
+    // The named fields; empty ones if the frame is another message
+    template <typename Message>
+    Message as() const {
+        Message message;
+        if (opcode == Message::OPCODE) {
+            message.bind(fields);
+        }
+        return message;
+    }
+};
+
+// False for an unknown command or a missing required field. The views point
+// into frame, which must outlive them.
+inline bool decodeFrame(StringView frame, Frame& out) {
+    size_t bar = frame.find('|');
+    out.opcode = lookupOpcode(frame.substr(0, bar));
+    out.fieldCount = 0;
+    for (size_t i = 0; i < FRAME_MAX_FIELDS; ++i) {
+        out.fields[i] = StringView();
+    }
+    if (out.opcode == OP_UNKNOWN) {
+        return false;
+    }
+
+    size_t fields = OPCODE_FIELDS[out.opcode];
+    while (bar != StringView::npos && out.fieldCount < fields) {
+        size_t start = bar + 1;
+        bar = (out.fieldCount + 1 < fields) ? frame.find('|', start) : StringView::npos;
+        out.fields[out.fieldCount++] = frame.substr(start, bar - start);
+    }
+    return out.fieldCount >= OPCODE_REQUIRED[out.opcode];
+}
+
+// Frames that set up or acknowledge a session belong to one connection: they
+// are not numbered, logged or resent (frame may still end with FRAME_END)
+inline bool isSessionFrame(StringView frame) {
+    size_t end = frame.find('|');
+    if (end == StringView::npos) {
+        end = frame.find(FRAME_END);
+    }
+    switch (lookupOpcode(frame.substr(0, end))) {
+    case OP_REGISTER:
+    case OP_REGISTERED:
+    case OP_SESSION:
+    case OP_SESSION_ACK:
+    case OP_RESUME:
+    case OP_RESUMED:
+    case OP_RESUME_FAILED:
+        return false;
+    default:
+        return true;
+    }
+}
+
+// Encoders: appendFrame<Wire::SendMsg>(out, fromId, toId, seq, message). A
+// wrong number of fields does not compile. Fields are strings or unsigned
+// numbers; more list items go on with appendField.
+inline void appendField(std::string& out, StringView field) {
+    out += '|';
+    out.append(field.data(), field.size());
+}
+
+inline void appendField(std::string& out, unsigned long long field) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = static_cast<char>('0' + field % 10);
+        field /= 10;
+    } while (field);
+    out += '|';
+    while (n) {
+        out += digits[--n];
+    }
+}
+
+inline void appendFields(std::string&) {}
+
+template <typename Field, typename... Fields>
+void appendFields(std::string& out, const Field& field, const Fields&... fields) {
+    appendField(out, field);
+    appendFields(out, fields...);
+}
+
+template <typename Message, typename... Fields>
+std::string& appendFrame(std::string& out, const Fields&... fields) {
+    static_assert(sizeof...(Fields) >= Message::REQUIRED, "missing required fields for this message");
+    static_assert(sizeof...(Fields) <= Message::FIELDS, "too many fields for this message");
+    out += OPCODE_NAMES[Message::OPCODE];
+    appendFields(out, fields...);
+    return out;
+}
+
+template <typename Message, typename... Fields>
+std::string encode(const Fields&... fields) {
+    std::string out;
+    return appendFrame<Message>(out, fields...);
+}
+
+}
+
+#endif // CHAT_PROTOCOL_H
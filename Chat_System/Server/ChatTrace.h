@@ -0,0 +1,137 @@
+#ifndef CHAT_TRACE_H
+#define CHAT_TRACE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace CHAT_SYSTEM {
+
+// Per-message tracing shared by the server and the client library.
+//
+// Sampled messages carry a trace id on the wire ("seq:traceId"). Every hop
+// records spans with CLOCK_MONOTONIC timestamps, which are comparable between
+// processes on the same machine, and appends them to a Chrome/Perfetto trace
+// file (JSON array format, which may be left unterminated).
+//
+// Environment:
+//   CHAT_TRACE_FILE   - output file, tracing is off when unset
+//   CHAT_TRACE_SAMPLE - trace one message in N (client library only)
+class Tracer {
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // Open the output file once per process
+    void init(const std::string& processName) {
+        std::lock_guard<std::mutex> lock(fileMutex);
+        if (initialized) {
+            return;
+        }
+        initialized = true;
+
+        const char* path = getenv("CHAT_TRACE_FILE");
+        if (path == nullptr || *path == '\0') {
+            return;
+        }
+
+        // One file per process so that concurrent processes never interleave
+        std::string fileName = std::string(path) + "." + std::to_string(getpid()) + ".json";
+        out = fopen(fileName.c_str(), "w");
+        if (out == nullptr) {
+            return;
+        }
+
+        const char* sample = getenv("CHAT_TRACE_SAMPLE");
+        sampleEvery = sample ? strtoul(sample, nullptr, 10) : 0;
+
+        fprintf(out, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                getpid(), processName.c_str());
+        fflush(out);
+        enabledFlag.store(true, std::memory_order_release);
+    }
+
+    bool enabled() const {
+        return enabledFlag.load(std::memory_order_relaxed);
+    }
+
+    // New trace id if this message is sampled, 0 otherwise
+    unsigned long long sample() {
+        if (!enabled() || sampleEvery == 0) {
+            return 0;
+        }
+        unsigned long long n = counter.fetch_add(1, std::memory_order_relaxed);
+        if (n % sampleEvery != 0) {
+            return 0;
+        }
+        return (static_cast<unsigned long long>(getpid()) << 32) | (n / sampleEvery + 1);
+    }
+
+    // Monotonic time in microseconds
+    static long long nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Record a complete span
+    void span(const char* name, unsigned long long traceId, long long startUs, long long endUs) {
+        if (!enabled() || traceId == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(fileMutex);
+        fprintf(out, "{\"name\":\"%s\",\"cat\":\"chat\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+                     "\"pid\":%d,\"tid\":%ld,\"args\":{\"trace\":\"%llx\"}},\n",
+                name, startUs, endUs - startUs, getpid(), static_cast<long>(syscall(SYS_gettid)), traceId);
+        fflush(out);
+    }
+
+    // Wire format of a trace id
+    static std::string format(unsigned long long traceId) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%llx", traceId);
+        return buffer;
+    }
+
+    // Trace id of a "seq:traceId" field, 0 if the field is not traced
+    static unsigned long long parse(const std::string& field) {
+        return parse(field.data(), field.length());
+    }
+
+    // Same for a field that is not NUL-terminated (a view into a frame)
+    static unsigned long long parse(const char* field, size_t length) {
+        const char* colon = static_cast<const char*>(memchr(field, ':', length));
+        if (colon == nullptr) {
+            return 0;
+        }
+        unsigned long long traceId = 0;
+        for (const char* p = colon + 1; p < field + length && isxdigit(static_cast<unsigned char>(*p)); ++p) {
+            traceId = traceId * 16 + (isdigit(static_cast<unsigned char>(*p)) ? *p - '0' : (*p | 0x20) - 'a' + 10);
+        }
+        return traceId;
+    }
+
+private:
+    Tracer() : out(nullptr), initialized(false), sampleEvery(0), counter(0), enabledFlag(false) {}
+    Tracer(const Tracer&);
+    Tracer& operator=(const Tracer&);
+
+    FILE* out;
+    bool initialized;
+    unsigned long sampleEvery;
+    std::atomic<unsigned long long> counter;
+    std::atomic<bool> enabledFlag;
+    std::mutex fileMutex;
+};
+
+}
+
+#endif // CHAT_TRACE_H
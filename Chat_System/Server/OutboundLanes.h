@@ -0,0 +1,115 @@
+#ifndef CHAT_OUTBOUND_LANES_H
+#define CHAT_OUTBOUND_LANES_H
+
+#include <string>
+#include <deque>
+#include <atomic>
+#include <chrono>
+
+namespace CHAT_SYSTEM {
+
+// Priority classes of outbound frames, highest first
+enum Lane {
+    LANE_CONTROL = 0,   // registration, presence, client list queries, errors
+    LANE_RECEIPT = 1,   // RESULT / RESULT_ACK and their batched forms
+    LANE_BULK = 2,      // user messages
+    LANE_COUNT = 3
+};
+
+// Frames each lane may send per scheduling round. Higher lanes go first, but
+// a busy higher lane cannot starve the lower ones.
+static const int LANE_WEIGHTS[LANE_COUNT] = { 8, 4, 1 };
+
+static const char* const LANE_NAMES[LANE_COUNT] = { "control", "receipts", "bulk" };
+
+// Time frames spent queued in one lane; safe to update from any thread
+struct LaneStats {
+    std::atomic<unsigned long long> frames;
+    std::atomic<unsigned long long> totalWaitUs;
+    std::atomic<unsigned long long> maxWaitUs;
+
+    LaneStats() : frames(0), totalWaitUs(0), maxWaitUs(0) {}
+
+    void record(long long waitUs) {
+        unsigned long long wait = waitUs < 0 ? 0 : waitUs;
+        frames.fetch_add(1, std::memory_order_relaxed);
+        totalWaitUs.fetch_add(wait, std::memory_order_relaxed);
+        unsigned long long max = maxWaitUs.load(std::memory_order_relaxed);
+        while (wait > max && !maxWaitUs.compare_exchange_weak(max, wait, std::memory_order_relaxed)) {
+        }
+    }
+};
+
+// Per-connection outbound queue with weighted round robin between lanes.
+// Not thread-safe: the owner guards it with its own mutex.
+class OutboundLanes {
+public:
+    OutboundLanes() : queued(0) {
+        resetCredits();
+    }
+
+    void push(const std::string& frame, Lane lane) {
+        Queued entry;
+        entry.frame = frame;
+        entry.enqueued = std::chrono::steady_clock::now();
+        queues[lane].push_back(entry);
+        ++queued;
+    }
+
+    // Next frame to send and how long it waited, false if every lane is empty
+    bool pop(std::string& frame, Lane& lane, long long& waitUs) {
+        if (queued == 0) {
+            return false;
+        }
+
+        for (int round = 0; round < 2; ++round) {
+            for (int i = 0; i < LANE_COUNT; ++i) {
+                if (!queues[i].empty() && credits[i] > 0) {
+                    --credits[i];
+                    --queued;
+                    lane = static_cast<Lane>(i);
+                    frame.swap(queues[i].front().frame);
+                    waitUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - queues[i].front().enqueued).count();
+                    queues[i].pop_front();
+                    return true;
+                }
+            }
+            // Every non-empty lane used up its share: start a new round
+            resetCredits();
+        }
+        return false;
+    }
+
+    bool empty() const {
+        return queued == 0;
+    }
+
+    void clear() {
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            queues[i].clear();
+        }
+        queued = 0;
+        resetCredits();
+    }
+
+private:
+    struct Queued {
+        std::string frame;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    void resetCredits() {
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            credits[i] = LANE_WEIGHTS[i];
+        }
+    }
+
+    std::deque<Queued> queues[LANE_COUNT];
+    int credits[LANE_COUNT];
+    size_t queued;
+};
+
+}
+
+#endif // CHAT_OUTBOUND_LANES_H
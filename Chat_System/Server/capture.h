@@ -0,0 +1,130 @@
+#ifndef CHAT_CAPTURE_H
+#define CHAT_CAPTURE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+
+namespace CHAT_SYSTEM {
+
+// Capture file layout (host byte order):
+//   "CHATCAP1"
+//   records: u8 type | u32 connId | u64 timestampUs | u32 length | payload
+// timestampUs is measured from the start of the capture. OPEN and CLOSE
+// records have an empty payload; FRAME payloads exclude the FRAME_END byte.
+static const char CAPTURE_MAGIC[8] = { 'C', 'H', 'A', 'T', 'C', 'A', 'P', '1' };
+
+enum CaptureRecordType {
+    CAPTURE_OPEN = 0,
+    CAPTURE_FRAME = 1,
+    CAPTURE_CLOSE = 2
+};
+
+// Larger frames are not recorded, and a record claiming a longer payload is
+// treated as corrupt rather than allocated
+static const uint32_t CAPTURE_PAYLOAD_MAX = 16 * 1024 * 1024;
+
+struct CaptureRecord {
+    uint8_t type;
+    uint32_t connId;
+    uint64_t timestampUs;
+    std::string payload;
+};
+
+// Appends records from any thread; buffered and flushed at most every FLUSH_US
+class CaptureWriter {
+public:
+    CaptureWriter() : out(nullptr), lastFlushUs(0), active(false) {}
+
+    ~CaptureWriter() {
+        close();
+    }
+
+    bool open(const std::string& path) {
+        out = fopen(path.c_str(), "wb");
+        if (!out) {
+            return false;
+        }
+        start = std::chrono::steady_clock::now();
+        fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), out);
+        fflush(out);
+        active = true;
+        return true;
+    }
+
+    bool isOpen() const {
+        return active;
+    }
+
+    // Write out everything buffered and stop recording (any thread)
+    void close() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        active = false;
+        if (out) {
+            fclose(out);
+            out = nullptr;
+        }
+    }
+
+    void record(CaptureRecordType type, uint32_t connId, const std::string& payload) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (!out || payload.length() > CAPTURE_PAYLOAD_MAX) {
+            return;
+        }
+        uint64_t timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        uint8_t recordType = type;
+        uint32_t length = payload.length();
+
+        fwrite(&recordType, sizeof(recordType), 1, out);
+        fwrite(&connId, sizeof(connId), 1, out);
+        fwrite(&timestampUs, sizeof(timestampUs), 1, out);
+        fwrite(&length, sizeof(length), 1, out);
+        fwrite(payload.data(), 1, length, out);
+
+        if (type != CAPTURE_FRAME || timestampUs - lastFlushUs >= FLUSH_US) {
+            fflush(out);
+            lastFlushUs = timestampUs;
+        }
+    }
+
+private:
+    static const uint64_t FLUSH_US = 50000;
+
+    FILE* out;
+    std::chrono::steady_clock::time_point start;
+    uint64_t lastFlushUs;
+    std::atomic<bool> active;
+    std::mutex writeMutex;
+};
+
+// Check the file header
+inline bool readCaptureHeader(FILE* in) {
+    char magic[sizeof(CAPTURE_MAGIC)];
+    return fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+           std::string(magic, sizeof(magic)) == std::string(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+}
+
+// Read the next record, false at the end of the file or on a truncated or
+// corrupt record (unknown type, payload over CAPTURE_PAYLOAD_MAX)
+inline bool readCaptureRecord(FILE* in, CaptureRecord& record) {
+    uint32_t length;
+    if (fread(&record.type, sizeof(record.type), 1, in) != 1 ||
+        fread(&record.connId, sizeof(record.connId), 1, in) != 1 ||
+        fread(&record.timestampUs, sizeof(record.timestampUs), 1, in) != 1 ||
+        fread(&length, sizeof(length), 1, in) != 1) {
+        return false;
+    }
+    if (record.type > CAPTURE_CLOSE || length > CAPTURE_PAYLOAD_MAX) {
+        return false;
+    }
+    record.payload.resize(length);
+    return length == 0 || fread(&record.payload[0], 1, length, in) == length;
+}
+
+}
+
+#endif // CHAT_CAPTURE_H
@@ -0,0 +1,384 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "common.h"
+
+using namespace std;
+using namespace CHAT_SYSTEM;
+
+// Load generator for one server or a cluster of them. Clients are spread
+// round robin over the given nodes, all multiplexed on one thread with
+// poll(). Once every client sees every other one ACTIVE (through a presence
+// subscription), each sends its messages to random recipients, keeping up to
+// BENCH_WINDOW of them unreceipted; recipients answer each with a
+// RESULT_BATCH. Reports delivered messages per second and how many of them
+// had to cross to another node.
+
+// Messages a client may have sent without a receipt
+static const int BENCH_WINDOW = 32;
+// Give up on registration and presence after this long
+static const long long BENCH_SETUP_US = 60000000;
+// Give up on outstanding messages after this long without progress
+static const long long BENCH_STALL_US = 5000000;
+
+struct BenchClient {
+    int socket;
+    size_t node;
+    string clientId;
+    string outbound;
+    string inbound;
+    set<string> activePeers;   // other bench clients seen ACTIVE
+    unsigned long nextSeq;     // next message to send, from 1
+    unsigned long receipted;   // receipts received
+};
+
+struct LatencyStats {
+    vector<long long> samples;
+
+    void add(long long us) {
+        samples.push_back(us);
+    }
+
+    double percentileMs(double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+        sort(samples.begin(), samples.end());
+        size_t i = static_cast<size_t>(p * (samples.size() - 1));
+        return samples[i] / 1000.0;
+    }
+};
+
+long long nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class ChatBench {
+private:
+    vector<pair<string, int>> nodes;    // host, port
+    size_t clientCount;
+    unsigned long messagesPerClient;
+
+    vector<BenchClient> clients;
+    mt19937 random;
+
+    // Run
+    unsigned long long sentMessages;
+    unsigned long long remoteMessages;
+    unsigned long long deliveredMessages;
+    unsigned long long receipts;
+    vector<long long> sentAt;           // Key: client * messagesPerClient + seq - 1
+    LatencyStats roundTrip;
+    long long startUs;
+    long long endUs;
+
+public:
+    ChatBench(const vector<pair<string, int>>& n, size_t count, unsigned long messages)
+        : nodes(n), clientCount(count), messagesPerClient(messages), random(1),
+          sentMessages(0), remoteMessages(0), deliveredMessages(0), receipts(0), startUs(0), endUs(0) {}
+
+    ~ChatBench() {
+        for (auto& client : clients) {
+            if (client.socket != -1) {
+                close(client.socket);
+            }
+        }
+    }
+
+    // Connect and register every client, then wait until all of them are
+    // known ACTIVE everywhere
+    bool setUp() {
+        for (size_t i = 0; i < clientCount; ++i) {
+            BenchClient client;
+            client.node = i % nodes.size();
+            client.clientId = "bench" + to_string(i);
+            client.nextSeq = 1;
+            client.receipted = 0;
+            client.socket = openConnection(nodes[client.node].first, nodes[client.node].second);
+            if (client.socket == -1) {
+                return false;
+            }
+            clients.push_back(client);
+        }
+
+        // Watch every other bench client, so that no full client list is
+        // broadcast to them while the run is measured
+        for (auto& client : clients) {
+            appendFrame<Wire::Register>(client.outbound, client.clientId) += FRAME_END;
+            appendFrame<Wire::Subscribe>(client.outbound);
+            for (const auto& other : clients) {
+                if (other.clientId != client.clientId) {
+                    appendField(client.outbound, other.clientId);
+                }
+            }
+            client.outbound += FRAME_END;
+            flushOutbound(client);
+        }
+
+        long long deadline = nowUs() + BENCH_SETUP_US;
+        while (!converged()) {
+            if (nowUs() > deadline) {
+                cerr << "Clients did not see each other within " << BENCH_SETUP_US / 1000000 << "s" << endl;
+                return false;
+            }
+            pollClients(100);
+        }
+        sentAt.assign(clientCount * messagesPerClient, 0);
+        return true;
+    }
+
+    bool run() {
+        startUs = nowUs();
+        long long lastProgressUs = startUs;
+        unsigned long long total = clientCount * messagesPerClient;
+
+        while (receipts < total) {
+            for (size_t i = 0; i < clients.size(); ++i) {
+                fillWindow(i);
+            }
+            if (pollClients(100)) {
+                lastProgressUs = nowUs();
+            } else if (nowUs() - lastProgressUs > BENCH_STALL_US) {
+                cerr << "Stalled with " << total - receipts << " messages unreceipted" << endl;
+                break;
+            }
+        }
+
+        endUs = nowUs();
+        return receipts == total;
+    }
+
+    void report() {
+        double seconds = (endUs - startUs) / 1e6;
+
+        printf("\n%-28s %14zu\n", "nodes", nodes.size());
+        printf("%-28s %14zu\n", "clients", clientCount);
+        printf("%-28s %14llu\n", "messages sent", sentMessages);
+        printf("%-28s %14.1f\n", "remote recipients (%)",
+               sentMessages ? 100.0 * remoteMessages / sentMessages : 0);
+        printf("%-28s %14llu\n", "messages delivered", deliveredMessages);
+        printf("%-28s %14.3f\n", "duration (s)", seconds);
+        printf("%-28s %14.1f\n", "throughput (msgs/s)", seconds > 0 ? deliveredMessages / seconds : 0);
+        printf("%-28s %14.3f\n", "receipt round trip p50 (ms)", roundTrip.percentileMs(0.5));
+        printf("%-28s %14.3f\n", "receipt round trip p99 (ms)", roundTrip.percentileMs(0.99));
+    }
+
+private:
+    bool converged() const {
+        for (const auto& client : clients) {
+            if (client.socket == -1 || client.activePeers.size() + 1 < clientCount) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Send until the client has BENCH_WINDOW messages unreceipted
+    void fillWindow(size_t index) {
+        BenchClient& client = clients[index];
+        if (client.socket == -1) {
+            return;
+        }
+        long long now = nowUs();
+        while (client.nextSeq <= messagesPerClient && client.nextSeq - 1 - client.receipted < BENCH_WINDOW) {
+            size_t to = random() % (clientCount - 1);
+            if (to >= index) {
+                ++to;
+            }
+            remoteMessages += (clients[to].node != client.node) ? 1 : 0;
+            sentAt[index * messagesPerClient + client.nextSeq - 1] = now;
+
+            appendFrame<Wire::SendMsg>(client.outbound, client.clientId, clients[to].clientId,
+                                       client.nextSeq, "bench message") += FRAME_END;
+            ++client.nextSeq;
+            ++sentMessages;
+        }
+        flushOutbound(client);
+    }
+
+    int openConnection(const string& host, int port) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            cerr << "Failed to create socket" << endl;
+            return -1;
+        }
+
+        sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(port);
+        if (inet_pton(AF_INET, host.c_str(), &serverAddr.sin_addr) <= 0 ||
+            ::connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            cerr << "Connection to " << host << ":" << port << " failed" << endl;
+            close(sock);
+            return -1;
+        }
+
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+        return sock;
+    }
+
+    // Write as much as the socket takes
+    void flushOutbound(BenchClient& client) {
+        while (!client.outbound.empty()) {
+            ssize_t n = send(client.socket, client.outbound.data(), client.outbound.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                client.outbound.erase(0, n);
+            } else {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    client.outbound.clear();
+                }
+                return;
+            }
+        }
+    }
+
+    // Returns true if any frame was received
+    bool pollClients(int timeoutMs) {
+        vector<pollfd> fds;
+        vector<size_t> owners;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            if (clients[i].socket == -1) {
+                continue;
+            }
+            pollfd pfd;
+            pfd.fd = clients[i].socket;
+            pfd.events = POLLIN | (clients[i].outbound.empty() ? 0 : POLLOUT);
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owners.push_back(i);
+        }
+        if (fds.empty() || poll(&fds[0], fds.size(), timeoutMs) <= 0) {
+            return false;
+        }
+
+        bool received = false;
+        char buffer[16384];
+        for (size_t i = 0; i < fds.size(); ++i) {
+            BenchClient& client = clients[owners[i]];
+            if (fds[i].revents & POLLOUT) {
+                flushOutbound(client);
+            }
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            ssize_t n = recv(client.socket, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    cerr << client.clientId << " lost its connection" << endl;
+                    close(client.socket);
+                    client.socket = -1;
+                }
+                continue;
+            }
+
+            client.inbound.append(buffer, n);
+            size_t start = 0;
+            size_t end;
+            long long now = nowUs();
+            while ((end = client.inbound.find(FRAME_END, start)) != string::npos) {
+                onFrame(owners[i], StringView(client.inbound.data() + start, end - start), now);
+                start = end + 1;
+                received = true;
+            }
+            client.inbound.erase(0, start);
+            flushOutbound(client);
+        }
+        return received;
+    }
+
+    void onFrame(size_t index, StringView frame, long long now) {
+        BenchClient& client = clients[index];
+        Frame decoded;
+        if (!decodeFrame(frame, decoded)) {
+            return;
+        }
+
+        if (decoded.opcode == OP_PRESENCE) {
+            StringView entry;
+            for (FieldIterator it(decoded.as<Wire::Presence>().entries); it.next(entry);) {
+                size_t colon = entry.find(':');
+                if (colon == StringView::npos) {
+                    continue;
+                }
+                if (entry.substr(colon + 1) == "ACTIVE") {
+                    client.activePeers.insert(entry.substr(0, colon).str());
+                } else {
+                    client.activePeers.erase(entry.substr(0, colon).str());
+                }
+            }
+        }
+        else if (decoded.opcode == OP_MESSAGE) {
+            // Receipt it right away
+            Wire::Message msg = decoded.as<Wire::Message>();
+            ++deliveredMessages;
+            appendFrame<Wire::ResultBatch>(client.outbound, client.clientId, msg.fromId,
+                                           msg.seq, msg.seq, "OK") += FRAME_END;
+        }
+        else if (decoded.opcode == OP_RESULT_ACK_BATCH) {
+            Wire::ResultAckBatch msg = decoded.as<Wire::ResultAckBatch>();
+            unsigned long long last = msg.lastSeq.toNumber();
+            for (unsigned long long seq = msg.firstSeq.toNumber(); seq <= last && seq <= messagesPerClient; ++seq) {
+                long long& sent = sentAt[index * messagesPerClient + seq - 1];
+                if (sent) {
+                    roundTrip.add(now - sent);
+                    sent = 0;
+                    ++client.receipted;
+                    ++receipts;
+                }
+            }
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " <clients> <messagesPerClient> <host:port> [host:port...]" << endl;
+        cout << "Example: " << argv[0] << " 16 2000 127.0.0.1:8080 127.0.0.1:8081" << endl;
+        return 1;
+    }
+
+    size_t clientCount = strtoul(argv[1], nullptr, 10);
+    unsigned long messages = strtoul(argv[2], nullptr, 10);
+    vector<pair<string, int>> nodes;
+    for (int i = 3; i < argc; ++i) {
+        string address = argv[i];
+        size_t colon = address.rfind(':');
+        if (colon == string::npos) {
+            nodes.push_back(make_pair(address, SERVER_DEFAULT));
+        } else {
+            nodes.push_back(make_pair(address.substr(0, colon), atoi(address.c_str() + colon + 1)));
+        }
+    }
+    if (clientCount < 2) {
+        cerr << "At least 2 clients are needed" << endl;
+        return 1;
+    }
+
+    ChatBench bench(nodes, clientCount, messages);
+    if (!bench.setUp()) {
+        return 1;
+    }
+    bool complete = bench.run();
+
+    bench.report();
+    return complete ? 0 : 1;
+}
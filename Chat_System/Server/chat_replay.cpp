@@ -0,0 +1,579 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "common.h"
+#include "capture.h"
+
+using namespace std;
+using namespace CHAT_SYSTEM;
+
+// Replays a capture written by "server <port> <captureFile>" against a running
+// server. All captured connections are multiplexed on one thread with poll().
+// Speed 1 keeps the recorded timing, 0 sends as fast as the server accepts.
+// Frames keep the order the recorded clients saw, on every connection: each
+// REGISTER waits for the CLIENT_LIST broadcast that completes it before
+// anything else is sent, each RESULT_BATCH waits for the delivery of the
+// messages it covers, and a connection closes only once the messages to its
+// client are delivered (each wait lasts at most REPLAY_DRAIN_US). At speed 0
+// captured disconnects are dropped as well (all connections close at the
+// end), so that messages are not lost to a disconnect overtaking them.
+// Messages the server answers with an ERROR are counted as failed.
+// A captured RESUME is replayed as a REGISTER of the same client.
+// The replayed duration ends with the last frame sent or received.
+
+// Stop queueing frames on a connection while this much is still unsent
+static const size_t REPLAY_OUTBOUND_MAX = 64 * 1024;
+// Wait this long for outstanding deliveries and receipts after the last frame,
+// and at most this long for a delivery a receipt waits for
+static const long long REPLAY_DRAIN_US = 2000000;
+
+struct ReplayConnection {
+    int socket;
+    bool registering;
+    bool closing;       // write side shut down, read until the server closes
+    string clientId;
+    string outbound;
+    string inbound;
+};
+
+struct LatencyStats {
+    vector<long long> samples;
+
+    void add(long long us) {
+        samples.push_back(us);
+    }
+
+    double percentileMs(double p) {
+        if (samples.empty()) {
+            return 0;
+        }
+        sort(samples.begin(), samples.end());
+        size_t i = static_cast<size_t>(p * (samples.size() - 1));
+        return samples[i] / 1000.0;
+    }
+};
+
+long long nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Messages waiting for their delivery or receipt, with their send time.
+// Key: fromId|toId, then seq (the trace id, if any, is dropped), so that a
+// receipt's range is matched against the messages sent instead of seq by seq
+typedef map<string, map<unsigned long long, long long>> ReceiptWait;
+
+string pairKey(StringView fromId, StringView toId) {
+    return fromId.str() + "|" + toId.str();
+}
+
+// Call done(sentUs) for every waiting message in first..last and forget it
+template <typename Done>
+void completeReceipts(ReceiptWait& waiting, const string& pair, unsigned long long first,
+                      unsigned long long last, Done done) {
+    auto it = waiting.find(pair);
+    if (it == waiting.end() || first > last) {
+        return;
+    }
+    auto seq = it->second.lower_bound(first);
+    while (seq != it->second.end() && seq->first <= last) {
+        done(seq->second);
+        seq = it->second.erase(seq);
+    }
+    if (it->second.empty()) {
+        waiting.erase(it);
+    }
+}
+
+// Whether any message in first..last is still waiting
+bool anyWaiting(const ReceiptWait& waiting, const string& pair, unsigned long long first, unsigned long long last) {
+    auto it = waiting.find(pair);
+    if (it == waiting.end()) {
+        return false;
+    }
+    auto seq = it->second.lower_bound(first);
+    return seq != it->second.end() && seq->first <= last;
+}
+
+// Whether any message to toId is still waiting
+bool anyWaitingFor(const ReceiptWait& waiting, const string& toId) {
+    string suffix = "|" + toId;
+    for (const auto& pair : waiting) {
+        if (pair.first.length() > suffix.length() &&
+            pair.first.compare(pair.first.length() - suffix.length(), suffix.length(), suffix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t countWaiting(const ReceiptWait& waiting) {
+    size_t count = 0;
+    for (const auto& pair : waiting) {
+        count += pair.second.size();
+    }
+    return count;
+}
+
+class ChatReplay {
+private:
+    string serverIP;
+    int serverPort;
+    double speed;
+
+    vector<CaptureRecord> records;
+    map<uint32_t, ReplayConnection> connections; // Key: captured connection id
+
+    // Recorded run
+    uint64_t recordedFrames;
+    LatencyStats recordedRoundTrip;
+
+    // Replayed run
+    uint64_t replayedFrames;
+    uint64_t receivedFrames;
+    uint64_t failedMessages;            // answered with an ERROR
+    ReceiptWait deliveryDue;            // waiting for delivery
+    ReceiptWait receiptDue;             // waiting for the receipt
+    LatencyStats deliveryLatency;
+    LatencyStats replayRoundTrip;
+    LatencyStats scheduleLag;
+    long long replayStartUs;
+    long long replayEndUs;              // last frame sent or received
+
+public:
+    ChatReplay(const string& ip, int port, double s)
+        : serverIP(ip), serverPort(port), speed(s), recordedFrames(0),
+          replayedFrames(0), receivedFrames(0), failedMessages(0), replayStartUs(0), replayEndUs(0) {}
+
+    ~ChatReplay() {
+        for (auto& pair : connections) {
+            if (pair.second.socket != -1) {
+                close(pair.second.socket);
+            }
+        }
+    }
+
+    bool load(const string& path) {
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in) {
+            cerr << "Failed to open " << path << endl;
+            return false;
+        }
+        if (!readCaptureHeader(in)) {
+            cerr << path << " is not a capture file" << endl;
+            fclose(in);
+            return false;
+        }
+
+        CaptureRecord record;
+        while (readCaptureRecord(in, record)) {
+            records.push_back(record);
+        }
+        if (!feof(in)) {
+            cerr << path << ": corrupt record after " << records.size() << " records, replaying those" << endl;
+        }
+        fclose(in);
+
+        analyzeRecording();
+        return !records.empty();
+    }
+
+    bool run() {
+        replayStartUs = nowUs();
+        long long lastActivityUs = replayStartUs;
+        size_t next = 0;
+
+        while (true) {
+            long long now = nowUs();
+
+            // Dispatch every record that is due
+            while (next < records.size()) {
+                const CaptureRecord& record = records[next];
+                long long dueUs = replayStartUs + static_cast<long long>(record.timestampUs / (speed > 0 ? speed : 1));
+                if (speed > 0 && dueUs > now) {
+                    break;
+                }
+                auto it = connections.find(record.connId);
+                if (speed == 0 && it != connections.end() && it->second.outbound.size() >= REPLAY_OUTBOUND_MAX) {
+                    break;
+                }
+                if ((registering() || awaitingDelivery(record)) && now - lastActivityUs <= REPLAY_DRAIN_US) {
+                    break;
+                }
+                if (speed > 0) {
+                    scheduleLag.add(now - dueUs);
+                }
+                if (!dispatch(record, now)) {
+                    return false;
+                }
+                lastActivityUs = now;
+                ++next;
+            }
+
+            bool outboundPending = false;
+            for (const auto& pair : connections) {
+                outboundPending = outboundPending || !pair.second.outbound.empty();
+            }
+            if (next == records.size() && !outboundPending &&
+                ((deliveryDue.empty() && receiptDue.empty()) || now - lastActivityUs > REPLAY_DRAIN_US)) {
+                break;
+            }
+
+            // Sleep until the next record is due or a socket is ready
+            int timeoutMs = 100;
+            if (next < records.size() && speed > 0) {
+                long long dueUs = replayStartUs + static_cast<long long>(records[next].timestampUs / speed);
+                timeoutMs = static_cast<int>(max(0LL, (dueUs - now) / 1000));
+            }
+            if (pollConnections(min(timeoutMs, 100))) {
+                lastActivityUs = nowUs();
+            }
+        }
+
+        // Let the server read everything before the connections close
+        for (auto& pair : connections) {
+            if (pair.second.socket != -1 && !pair.second.closing) {
+                shutdownConnection(pair.second);
+            }
+        }
+        long long endUs = replayEndUs;
+        long long deadlineUs = nowUs() + REPLAY_DRAIN_US;
+        while (openConnections() && nowUs() < deadlineUs) {
+            pollConnections(100);
+        }
+        replayEndUs = max(endUs, replayStartUs);
+        return true;
+    }
+
+    void report() {
+        double recordedSec = records.empty() ? 0 : records.back().timestampUs / 1e6;
+        double replaySec = (replayEndUs - replayStartUs) / 1e6;
+        double recordedRate = recordedSec > 0 ? recordedFrames / recordedSec : 0;
+        double replayRate = replaySec > 0 ? replayedFrames / replaySec : 0;
+
+        printf("\n%-28s %14s %14s\n", "", "recorded", "replayed");
+        printf("%-28s %14.3f %14.3f\n", "duration (s)", recordedSec, replaySec);
+        printf("%-28s %14llu %14llu\n", "inbound frames",
+               (unsigned long long)recordedFrames, (unsigned long long)replayedFrames);
+        printf("%-28s %14.1f %14.1f\n", "throughput (frames/s)", recordedRate, replayRate);
+        printf("%-28s %14.3f %14.3f\n", "receipt round trip p50 (ms)",
+               recordedRoundTrip.percentileMs(0.5), replayRoundTrip.percentileMs(0.5));
+        printf("%-28s %14.3f %14.3f\n", "receipt round trip p99 (ms)",
+               recordedRoundTrip.percentileMs(0.99), replayRoundTrip.percentileMs(0.99));
+        printf("%-28s %14s %14.3f\n", "delivery p50 (ms)", "-", deliveryLatency.percentileMs(0.5));
+        printf("%-28s %14s %14.3f\n", "delivery p99 (ms)", "-", deliveryLatency.percentileMs(0.99));
+        if (speed > 0) {
+            printf("%-28s %14s %14.3f\n", "schedule lag p99 (ms)", "-", scheduleLag.percentileMs(0.99));
+        }
+        printf("%-28s %14s %14llu\n", "frames received", "-", (unsigned long long)receivedFrames);
+        printf("%-28s %14s %14zu\n", "undelivered messages", "-", countWaiting(deliveryDue));
+        printf("%-28s %14s %14llu\n", "failed messages", "-", (unsigned long long)failedMessages);
+
+        printf("\nDivergence: throughput x%.2f, round trip p50 %+.3f ms, p99 %+.3f ms\n",
+               recordedRate > 0 ? replayRate / recordedRate : 0,
+               replayRoundTrip.percentileMs(0.5) - recordedRoundTrip.percentileMs(0.5),
+               replayRoundTrip.percentileMs(0.99) - recordedRoundTrip.percentileMs(0.99));
+    }
+
+private:
+    // Round trip as the recording server saw it: SEND_MSG to the RESULT_BATCH covering it
+    void analyzeRecording() {
+        ReceiptWait pending;
+
+        for (const auto& record : records) {
+            if (record.type != CAPTURE_FRAME) {
+                continue;
+            }
+            ++recordedFrames;
+
+            Frame frame;
+            if (!decodeFrame(record.payload, frame)) {
+                continue;
+            }
+            if (frame.opcode == OP_SEND_MSG) {
+                Wire::SendMsg msg = frame.as<Wire::SendMsg>();
+                pending[pairKey(msg.fromId, msg.toId)][msg.seq.toNumber()] = record.timestampUs;
+            }
+            else if (frame.opcode == OP_RESULT_BATCH) {
+                Wire::ResultBatch msg = frame.as<Wire::ResultBatch>();
+                long long receivedUs = record.timestampUs;
+                completeReceipts(pending, pairKey(msg.toId, msg.fromId), msg.firstSeq.toNumber(),
+                                 msg.lastSeq.toNumber(), [&](long long sentUs) {
+                    recordedRoundTrip.add(receivedUs - sentUs);
+                });
+            }
+        }
+    }
+
+    bool dispatch(const CaptureRecord& record, long long now) {
+        if (record.type == CAPTURE_OPEN) {
+            return openConnection(record.connId);
+        }
+
+        auto it = connections.find(record.connId);
+        if (it == connections.end() || it->second.socket == -1 || it->second.closing) {
+            return true;
+        }
+        ReplayConnection& conn = it->second;
+
+        if (record.type == CAPTURE_CLOSE) {
+            if (speed == 0) {
+                return true;
+            }
+            flushOutbound(conn, true);
+            shutdownConnection(conn);
+            return true;
+        }
+
+        Frame frame;
+        bool known = decodeFrame(record.payload, frame);
+        if (known && frame.opcode == OP_DISCONNECT && speed == 0) {
+            return true;
+        }
+        if (known && frame.opcode == OP_RESUME) {
+            // The replayed server never issued this session: register instead
+            conn.clientId = frame.as<Wire::Resume>().clientId.str();
+            conn.registering = true;
+            appendFrame<Wire::Register>(conn.outbound, conn.clientId);
+        } else {
+            if (known && frame.opcode == OP_REGISTER) {
+                conn.clientId = frame.as<Wire::Register>().clientId.str();
+                conn.registering = true;
+            }
+            else if (known && frame.opcode == OP_SEND_MSG) {
+                Wire::SendMsg msg = frame.as<Wire::SendMsg>();
+                deliveryDue[pairKey(msg.fromId, msg.toId)][msg.seq.toNumber()] = now;
+                receiptDue[pairKey(msg.fromId, msg.toId)][msg.seq.toNumber()] = now;
+            }
+            conn.outbound += record.payload;
+        }
+        conn.outbound += FRAME_END;
+        ++replayedFrames;
+        flushOutbound(conn, false);
+        return true;
+    }
+
+    bool openConnection(uint32_t connId) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) {
+            cerr << "Failed to create socket" << endl;
+            return false;
+        }
+
+        sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(serverPort);
+        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0 ||
+            ::connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            cerr << "Connection to server failed" << endl;
+            close(sock);
+            return false;
+        }
+
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+        ReplayConnection conn;
+        conn.socket = sock;
+        conn.registering = false;
+        conn.closing = false;
+        connections[connId] = conn;
+        return true;
+    }
+
+    // close() with unread input would reset the connection and discard what
+    // the server has not read yet: shut the write side, then read until the
+    // server closes (pollConnections)
+    void shutdownConnection(ReplayConnection& conn) {
+        shutdown(conn.socket, SHUT_WR);
+        conn.closing = true;
+    }
+
+    bool openConnections() const {
+        for (const auto& pair : connections) {
+            if (pair.second.socket != -1) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Replayed ahead of the messages it covers, a captured RESULT_BATCH would
+    // be dropped by the server as never delivered, and a captured close would
+    // leave those messages queued for a client that is gone
+    bool awaitingDelivery(const CaptureRecord& record) const {
+        if (record.type == CAPTURE_CLOSE) {
+            auto it = connections.find(record.connId);
+            return it != connections.end() && !it->second.clientId.empty() &&
+                   anyWaitingFor(deliveryDue, it->second.clientId);
+        }
+
+        Frame frame;
+        if (record.type != CAPTURE_FRAME || !decodeFrame(record.payload, frame) ||
+            frame.opcode != OP_RESULT_BATCH) {
+            return false;
+        }
+        Wire::ResultBatch msg = frame.as<Wire::ResultBatch>();
+        return anyWaiting(deliveryDue, pairKey(msg.toId, msg.fromId), msg.firstSeq.toNumber(),
+                          msg.lastSeq.toNumber());
+    }
+
+    // Write as much as the socket takes (everything if blocking is set)
+    void flushOutbound(ReplayConnection& conn, bool blocking) {
+        while (!conn.outbound.empty()) {
+            ssize_t n = send(conn.socket, conn.outbound.data(), conn.outbound.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.outbound.erase(0, n);
+                replayEndUs = nowUs();
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && blocking) {
+                pollfd pfd = { conn.socket, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+            } else {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    conn.outbound.clear();
+                }
+                return;
+            }
+        }
+    }
+
+    bool registering() const {
+        for (const auto& pair : connections) {
+            if (pair.second.registering && pair.second.socket != -1) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns true if any frame was received
+    bool pollConnections(int timeoutMs) {
+        vector<pollfd> fds;
+        vector<ReplayConnection*> owners;
+        for (auto& pair : connections) {
+            if (pair.second.socket == -1) {
+                continue;
+            }
+            pollfd pfd;
+            pfd.fd = pair.second.socket;
+            pfd.events = POLLIN | (pair.second.outbound.empty() ? 0 : POLLOUT);
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owners.push_back(&pair.second);
+        }
+        if (fds.empty()) {
+            usleep(timeoutMs * 1000);
+            return false;
+        }
+        if (poll(&fds[0], fds.size(), timeoutMs) <= 0) {
+            return false;
+        }
+
+        bool received = false;
+        char buffer[4096];
+        for (size_t i = 0; i < fds.size(); ++i) {
+            ReplayConnection& conn = *owners[i];
+            if (fds[i].revents & POLLOUT) {
+                flushOutbound(conn, false);
+            }
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            ssize_t n = recv(conn.socket, buffer, sizeof(buffer), 0);
+            if (n <= 0) {
+                if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    close(conn.socket);
+                    conn.socket = -1;
+                }
+                continue;
+            }
+
+            conn.inbound.append(buffer, n);
+            size_t start = 0;
+            size_t end;
+            long long now = nowUs();
+            while ((end = conn.inbound.find(FRAME_END, start)) != string::npos) {
+                onFrame(conn, StringView(conn.inbound.data() + start, end - start), now);
+                start = end + 1;
+                received = true;
+            }
+            conn.inbound.erase(0, start);
+        }
+        return received;
+    }
+
+    void onFrame(ReplayConnection& conn, StringView frame, long long now) {
+        ++receivedFrames;
+        replayEndUs = now;
+        Frame decoded;
+        if (!decodeFrame(frame, decoded)) {
+            return;
+        }
+
+        if (decoded.opcode == OP_CLIENT_LIST) {
+            conn.registering = false;
+        }
+        else if (decoded.opcode == OP_MESSAGE) {
+            Wire::Message msg = decoded.as<Wire::Message>();
+            unsigned long long seq = msg.seq.toNumber();
+            completeReceipts(deliveryDue, pairKey(msg.fromId, conn.clientId), seq, seq, [&](long long sentUs) {
+                deliveryLatency.add(now - sentUs);
+            });
+        }
+        else if (decoded.opcode == OP_RESULT_ACK_BATCH) {
+            Wire::ResultAckBatch msg = decoded.as<Wire::ResultAckBatch>();
+            completeReceipts(receiptDue, pairKey(conn.clientId, msg.fromId), msg.firstSeq.toNumber(),
+                             msg.lastSeq.toNumber(), [&](long long sentUs) {
+                replayRoundTrip.add(now - sentUs);
+            });
+        }
+        else if (decoded.opcode == OP_ERROR) {
+            // About a message of this client: it will never be delivered
+            Wire::Error msg = decoded.as<Wire::Error>();
+            unsigned long long seq = msg.seq.toNumber();
+            string pair = pairKey(conn.clientId, msg.toId);
+            completeReceipts(deliveryDue, pair, seq, seq, [&](long long) {
+                ++failedMessages;
+            });
+            completeReceipts(receiptDue, pair, seq, seq, [](long long) {});
+        }
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cout << "Usage: " << argv[0] << " <captureFile> <serverIP> <serverPort> [speed]" << endl;
+        cout << "  speed 1 = recorded timing (default), 2 = twice as fast, 0 = as fast as possible" << endl;
+        cout << "Example: " << argv[0] << " capture.bin 127.0.0.1 8080 0" << endl;
+        return 1;
+    }
+
+    double speed = argc > 4 ? atof(argv[4]) : 1.0;
+    ChatReplay replay(argv[2], atoi(argv[3]), speed < 0 ? 0 : speed);
+
+    if (!replay.load(argv[1])) {
+        return 1;
+    }
+    if (!replay.run()) {
+        return 1;
+    }
+
+    replay.report();
+    return 0;
+}
@@ -2,20 +2,64 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
+#include <memory>
+#include <algorithm>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
 #include <cstring>
+#include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <unistd.h>
 #include "common.h"
+#include "ChatTrace.h"
+#include "capture.h"
+#include "OutboundLanes.h"
 
 
 
 using namespace std;
 using namespace CHAT_SYSTEM;
 
+// One TCP connection. Any thread queues frames on it (sendFrame); its
+// writer thread sends them in priority order (ChatServer::writeLoop).
+struct Connection {
+    unsigned long id;
+    int socket;
+    sockaddr_in addr;
+    
+    mutex sendMutex;                 // guards lanes, closing, suspended and the sent log
+    condition_variable sendReady;
+    OutboundLanes lanes;
+    bool closing;
+    bool suspended;                  // dropped, but frames are kept for a RESUME
+    
+    // Session frames (isSessionFrame) handed to the socket, numbered across
+    // the session, and those the client has not acknowledged yet
+    unsigned long long framesWritten;
+    deque<pair<Lane, string>> sentLog;
+    size_t sentLogBytes;
+    
+    // Session frames read, numbered across the session
+    atomic<unsigned long long> framesReceived;
+    unsigned long long framesAcked;  // reader thread only: last SESSION_ACK sent
+    
+    // Set on links between cluster nodes: the id of the node at the other end
+    string peerNode;
+    
+    Connection() : id(0), socket(-1), closing(false), suspended(false), framesWritten(0),
+                   sentLogBytes(0), framesReceived(0), framesAcked(0) {}
+};
+
 // Structure to store client information
 struct ClientInfo {
     string clientId;
@@ -23,8 +67,60 @@ struct ClientInfo {
     int port;
     int socket;
     bool isActive;
+    bool subscribed;    // gets PRESENCE deltas for its subscriptions instead of CLIENT_LIST
+    string resumeToken; // proves ownership of the session in RESUME
+    string node;        // owning node for clients of other cluster nodes (conn is null)
+    map<string, unsigned long> deliveredSeq; // Key: sender, last message seq delivered here
+    shared_ptr<Connection> conn;
+};
+
+// One client in the presence snapshot, encoded once as "clientId:STATUS"
+struct PresenceEntry {
+    string clientId;
+    string encoded;
 };
 
+// Immutable roster view used by broadcasts and GETLISTID queries.
+// A new snapshot shares every unchanged entry with the previous one.
+struct PresenceSnapshot {
+    unsigned long version;
+    vector<shared_ptr<const PresenceEntry>> entries; // sorted by clientId
+    
+    // Encoded responses for this version, shared by all requesters
+    mutable mutex cacheMutex;
+    mutable map<string, shared_ptr<const string>> encoded;
+    
+    PresenceSnapshot() : version(0) {}
+};
+
+// Upper bound on cached responses per snapshot version
+static const size_t PRESENCE_CACHE_MAX = 64;
+
+// Largest write the writer thread assembles from queued frames, so that a
+// frame queued later on a higher lane never waits behind much bulk data
+static const size_t WRITE_BATCH_BYTES = 16 * 1024;
+
+// How long a dropped client's session waits for a RESUME before it goes INACTIVE
+static const int RESUME_GRACE_SEC = 10;
+
+// Delay before a node dials a peer again after a failed or lost link
+static const int PEER_RETRY_MS = 1000;
+
+// How often lane and presence statistics are printed (only when there was traffic)
+static const int STATS_INTERVAL_SEC = 10;
+
+// Queue one frame, terminated by FRAME_END, on the connection's lane.
+// A suspended connection keeps the frame for the client's RESUME.
+bool sendFrame(Connection& conn, const string& frame, Lane lane) {
+    lock_guard<mutex> lock(conn.sendMutex);
+    if (conn.closing && !conn.suspended) {
+        return false;
+    }
+    conn.lanes.push(frame + FRAME_END, lane);
+    conn.sendReady.notify_one();
+    return true;
+}
+
 class ChatServer {
 private:
     int serverSocket;
@@ -32,8 +128,90 @@ private:
     map<string, ClientInfo> clients; // Key: clientId
     mutex clientsMutex;
     
+    // Live roster, updated in place on every status change (guarded by
+    // presenceMutex). Changes cost O(log n); the immutable snapshot queries
+    // read is rebuilt from it only when a query finds it out of date.
+    mutex presenceMutex;
+    map<string, shared_ptr<const PresenceEntry>> presenceEntries; // Key: clientId
+    atomic<unsigned long> presenceVersion;
+    
+    // Latest built presence snapshot, replaced atomically under presenceMutex
+    shared_ptr<const PresenceSnapshot> presence;
+    
+    // Inbound traffic capture for chat_replay (inactive unless opened)
+    CaptureWriter capture;
+    atomic<unsigned long> nextConnectionId;
+    
+    // Time frames spend in the outbound queues, per lane, over all connections
+    LaneStats laneStats[LANE_COUNT];
+    
+    // Presence subscriptions, both directions kept in step (guarded by clientsMutex)
+    map<string, set<string>> subscribers;   // Key: watched clientId, value: subscriber clientIds
+    map<string, set<string>> subscriptions; // Key: subscriber clientId, value: watched clientIds
+    
+    // Presence fan-out: status changes and the frames they produced
+    atomic<unsigned long long> presenceChanges;
+    atomic<unsigned long long> presenceDeltas;      // PRESENCE frames to subscribers
+    atomic<unsigned long long> presenceBroadcasts;  // CLIENT_LIST frames to unsubscribed clients
+    atomic<unsigned long long> presenceMaxFanOut;
+    
+    // Resume tokens (guarded by clientsMutex)
+    mt19937_64 tokenGenerator;
+    
+    // Cluster. nodeId is what this node calls itself in NODE_HELLO, and
+    // clusterKey what every node of the cluster must present there.
+    // Clients of other nodes are kept in clients with ClientInfo::node set.
+    string nodeId;
+    string clusterKey;
+    // Outbound link to each peer, which carries this node's presence and the
+    // frames it forwards (guarded by clientsMutex). Key: the node id the
+    // peer answered NODE_HELLO with, which its presence is recorded under
+    map<string, shared_ptr<Connection>> peerLinks;
+    // Inbound link each peer currently announces its presence on (guarded by clientsMutex)
+    map<string, shared_ptr<Connection>> peerInbound;
+    atomic<unsigned long long> forwardedFrames;  // sent to peers for their clients
+    atomic<unsigned long long> peerFrames;       // delivered here for peers
+    
 public:
-    ChatServer(int p) : port(p), serverSocket(-1) {}
+    ChatServer(int p) : port(p), serverSocket(-1), presenceVersion(0),
+                        presence(make_shared<PresenceSnapshot>()), nextConnectionId(1),
+                        presenceChanges(0), presenceDeltas(0), presenceBroadcasts(0), presenceMaxFanOut(0),
+                        tokenGenerator(random_device()()), nodeId("127.0.0.1:" + to_string(p)),
+                        forwardedFrames(0), peerFrames(0) {}
+    
+    void setNodeId(const string& id) {
+        nodeId = id;
+    }
+    
+    // Links to and from nodes that do not present this key are refused;
+    // without a key this node accepts none
+    void setClusterKey(const string& key) {
+        clusterKey = key;
+    }
+    
+    // Join a cluster: keep a link to the peer at host:port
+    void addPeer(const string& address) {
+        thread(&ChatServer::peerLoop, this, address).detach();
+    }
+    
+    // Wait for one of the signals (blocked in every thread), then write out
+    // the capture and exit. Other threads are still running: skip destructors.
+    void waitForStop(sigset_t signals) {
+        int signal = 0;
+        sigwait(&signals, &signal);
+        capture.close();
+        cout << "Stopped by signal " << signal << endl;
+        _exit(0);
+    }
+    
+    bool startCapture(const string& path) {
+        if (!capture.open(path)) {
+            cerr << "Failed to open capture file " << path << endl;
+            return false;
+        }
+        cout << "Capturing inbound traffic to " << path << endl;
+        return true;
+    }
     
     ~ChatServer() {
         if (serverSocket != -1) {
@@ -81,175 +259,1208 @@ public:
                 continue;
             }
             
+            // Frames are already coalesced by the writer thread
+            int opt = 1;
+            setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            
             thread(&ChatServer::handleClient, this, clientSocket, clientAddr).detach();
         }
     }
     
+    // Print the outbound queue latency of every lane and the presence fan-out
+    void reportStats() {
+        unsigned long long reported = 0;
+        while (true) {
+            this_thread::sleep_for(chrono::seconds(STATS_INTERVAL_SEC));
+            
+            unsigned long long total = 0;
+            for (int i = 0; i < LANE_COUNT; ++i) {
+                total += laneStats[i].frames.load();
+            }
+            if (total == reported) {
+                continue;
+            }
+            reported = total;
+            
+            cout << "Outbound lanes:";
+            for (int i = 0; i < LANE_COUNT; ++i) {
+                unsigned long long frames = laneStats[i].frames.load();
+                cout << " " << LANE_NAMES[i] << " " << frames << " frames, avg "
+                     << (frames ? laneStats[i].totalWaitUs.load() / frames : 0) << "us max "
+                     << laneStats[i].maxWaitUs.load() << "us" << (i + 1 < LANE_COUNT ? " |" : "");
+            }
+            cout << endl;
+            
+            unsigned long long changes = presenceChanges.load();
+            unsigned long long deltas = presenceDeltas.load();
+            unsigned long long broadcasts = presenceBroadcasts.load();
+            if (changes) {
+                cout << "Presence: " << changes << " changes, " << deltas << " deltas to subscribers + "
+                     << broadcasts << " full lists to unsubscribed clients, avg fan-out "
+                     << (deltas + broadcasts) / changes << " max " << presenceMaxFanOut.load() << endl;
+            }
+            
+            if (forwardedFrames.load() || peerFrames.load()) {
+                cout << "Cluster: " << forwardedFrames.load() << " frames forwarded to peers, "
+                     << peerFrames.load() << " delivered for peers" << endl;
+            }
+        }
+    }
+    
     void handleClient(int clientSocket, sockaddr_in clientAddr) {
         char buffer[4096];
+        string pending;
         string clientId;
         
+        shared_ptr<Connection> conn = make_shared<Connection>();
+        conn->id = nextConnectionId++;
+        conn->socket = clientSocket;
+        conn->addr = clientAddr;
+        
+        if (capture.isOpen()) {
+            capture.record(CAPTURE_OPEN, conn->id, "");
+        }
+        
+        thread writer(&ChatServer::writeLoop, this, conn);
+        
         while (true) {
-            memset(buffer, 0, sizeof(buffer));
-            int bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+            int bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
             
             if (bytesRead <= 0) {
                 // Client disconnected
-                if (!clientId.empty()) {
-                    setClientInactive(clientId);
+                if (capture.isOpen()) {
+                    capture.record(CAPTURE_CLOSE, conn->id, "");
+                }
+                
+                if (!conn->peerNode.empty()) {
+                    nodeDown(conn->peerNode, conn);
                 }
+                
+                // Stop the writer before the socket can be reused
+                bool suspended = suspendConnection(clientId, conn);
+                conn->sendReady.notify_one();
+                shutdown(clientSocket, SHUT_RDWR);
+                writer.join();
                 close(clientSocket);
+                
+                if (suspended) {
+                    this_thread::sleep_for(chrono::seconds(RESUME_GRACE_SEC));
+                    expireSession(clientId, conn);
+                }
                 break;
             }
             
-            string message(buffer);
-            processMessage(clientSocket, clientAddr, message, clientId);
+            // Split the stream into frames (the bytes kept from the last read
+            // hold no FRAME_END)
+            size_t scanFrom = pending.length();
+            pending.append(buffer, bytesRead);
+            size_t start = 0;
+            size_t end;
+            while ((end = pending.find(FRAME_END, max(start, scanFrom))) != string::npos) {
+                StringView frame(pending.data() + start, end - start);
+                start = end + 1;
+                
+                if (isSessionFrame(frame)) {
+                    ++conn->framesReceived;
+                }
+                if (capture.isOpen() && conn->peerNode.empty() &&
+                    lookupOpcode(frame.substr(0, frame.find('|'))) != OP_NODE_HELLO) {
+                    capture.record(CAPTURE_FRAME, conn->id, frame.str());
+                }
+                processMessage(conn, frame, clientId);
+            }
+            
+            // Let the client drop what it keeps for resending
+            if (!clientId.empty() && conn->framesReceived - conn->framesAcked >= SESSION_ACK_FRAMES) {
+                conn->framesAcked = conn->framesReceived;
+                sendFrame(*conn, encode<Wire::SessionAck>(conn->framesAcked), LANE_CONTROL);
+            }
+            pending.erase(0, start);
+            
+            // An unterminated frame may not grow without bound: the next
+            // recv() reports a disconnect
+            if (pending.length() > FRAME_MAX_BYTES) {
+                cout << "Dropping connection " << conn->id << ": frame over " << FRAME_MAX_BYTES << " bytes" << endl;
+                pending.clear();
+                shutdown(clientSocket, SHUT_RD);
+            }
         }
     }
     
-    void processMessage(int socket, sockaddr_in addr, const string& msg, string& clientId) {
-        // Message format: COMMAND|DATA
-        size_t pos = msg.find('|');
-        if (pos == string::npos) return;
+    // Send queued frames, control first, with weighted fairness between lanes
+    void writeLoop(shared_ptr<Connection> conn) {
+        string batch;
+        string frame;
+        Lane lane;
+        long long waitUs;
         
-        string command = msg.substr(0, pos);
-        string data = msg.substr(pos + 1);
+        while (true) {
+            {
+                unique_lock<mutex> lock(conn->sendMutex);
+                conn->sendReady.wait(lock, [&conn]() { return conn->closing || !conn->lanes.empty(); });
+                if (conn->closing) {
+                    break;
+                }
+                while (batch.length() < WRITE_BATCH_BYTES && conn->lanes.pop(frame, lane, waitUs)) {
+                    laneStats[lane].record(waitUs);
+                    batch += frame;
+                    
+                    // Links between nodes are not resumed
+                    if (!conn->peerNode.empty() || !isSessionFrame(frame)) {
+                        continue;
+                    }
+                    // Counted as written even if the send below fails: a
+                    // resuming client reports what actually arrived
+                    ++conn->framesWritten;
+                    conn->sentLogBytes += frame.length();
+                    conn->sentLog.push_back(make_pair(lane, frame));
+                    while (conn->sentLogBytes > RESUME_LOG_BYTES) {
+                        conn->sentLogBytes -= conn->sentLog.front().second.length();
+                        conn->sentLog.pop_front();
+                    }
+                }
+            }
+            
+            size_t sent = 0;
+            while (sent < batch.length()) {
+                ssize_t n = send(conn->socket, batch.c_str() + sent, batch.length() - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    return;
+                }
+                sent += n;
+            }
+            batch.clear();
+        }
+    }
+    
+    void processMessage(const shared_ptr<Connection>& conn, StringView msg, string& clientId) {
+        // Message format: COMMAND|field|... (see ChatProtocol.h)
+        Frame frame;
+        if (!decodeFrame(msg, frame)) return;
         
-        if (command == REGISTER) {
-            // REGISTER|clientId
-            clientId = data;
-            registerClient(clientId, addr, socket);
+        if (!conn->peerNode.empty()) {
+            processPeerMessage(*conn, frame);
+            return;
         }
-        else if (command == SEND_MSG) {
-            // SEND_MSG|fromId|toId|message
-            handleSendMessage(data);
+        
+        // Frames that speak for a client must come from that client's connection
+        if (!sentByClient(frame, clientId)) {
+            cout << "Dropped " << opcodeName(frame.opcode) << " not sent by its client on connection "
+                 << conn->id << endl;
+            return;
+        }
+        
+        switch (frame.opcode) {
+        case OP_REGISTER: {
+            StringView id = frame.as<Wire::Register>().clientId;
+            if (!isValidClientId(id)) {
+                sendFrame(*conn, encode<Wire::Error>("Invalid client id"), LANE_CONTROL);
+                break;
+            }
+            clientId = id.str();
+            registerClient(clientId, conn);
+            break;
         }
-        else if (command == RESULT) {
-            // RESULT|fromId|toId|OK/NOT_OK
-            handleResult(data);
+        case OP_SEND_MSG:
+            handleSendMessage(frame.as<Wire::SendMsg>());
+            break;
+        case OP_RESULT:
+            handleResult(frame.as<Wire::Result>());
+            break;
+        case OP_RESULT_BATCH:
+            handleResultBatch(frame.as<Wire::ResultBatch>());
+            break;
+        case OP_RESUME:
+            handleResume(conn, frame.as<Wire::Resume>(), clientId);
+            break;
+        case OP_SESSION_ACK:
+            acknowledgeFrames(*conn, frame.as<Wire::SessionAck>().framesRead.toNumber());
+            break;
+        case OP_NODE_HELLO:
+            acceptNodeLink(conn, frame.as<Wire::NodeHello>(), clientId);
+            break;
+        case OP_NODE_PRESENCE:
+        case OP_NODE_DELIVER:
+            // Only valid on a peer's link, after NODE_HELLO
+            cout << "Dropped " << opcodeName(frame.opcode) << " from connection " << conn->id
+                 << ", not a node link" << endl;
+            break;
+        case OP_DISCONNECT:
+            setClientInactive(frame.as<Wire::Disconnect>().clientId.str());
+            break;
+        case OP_GETLISTID:
+            handleGetListId(*conn, frame.as<Wire::GetListId>());
+            break;
+        case OP_SUBSCRIBE:
+            handleSubscribe(clientId, frame.as<Wire::Subscribe>().clientIds, true);
+            break;
+        case OP_UNSUBSCRIBE:
+            handleSubscribe(clientId, frame.as<Wire::Unsubscribe>().clientIds, false);
+            break;
+        default:
+            break;
         }
-        else if (command == DISCONNECT) {
-            // DISCONNECT|clientId
-            setClientInactive(data);
+    }
+    
+    // The sender, receipt issuer or leaving client named in the frame is the
+    // one registered (or resumed) on this connection
+    static bool sentByClient(const Frame& frame, const string& clientId) {
+        StringView claimed;
+        switch (frame.opcode) {
+        case OP_SEND_MSG:
+            claimed = frame.as<Wire::SendMsg>().fromId;
+            break;
+        case OP_RESULT:
+            claimed = frame.as<Wire::Result>().fromId;
+            break;
+        case OP_RESULT_BATCH:
+            claimed = frame.as<Wire::ResultBatch>().fromId;
+            break;
+        case OP_DISCONNECT:
+            claimed = frame.as<Wire::Disconnect>().clientId;
+            break;
+        default:
+            return true;
         }
+        return !clientId.empty() && claimed == clientId;
     }
     
-    void registerClient(const string& clientId, sockaddr_in addr, int socket) {
+    void registerClient(const string& clientId, const shared_ptr<Connection>& conn) {
         lock_guard<mutex> lock(clientsMutex);
         
+        // A fresh registration replaces a session left waiting for RESUME
+        auto previous = clients.find(clientId);
+        if (previous != clients.end() && previous->second.conn && previous->second.conn != conn) {
+            bool suspended;
+            {
+                lock_guard<mutex> sendLock(previous->second.conn->sendMutex);
+                suspended = previous->second.conn->suspended;
+                previous->second.conn->suspended = false;
+            }
+            if (suspended) {
+                failQueuedMessages(*previous->second.conn, clientId);
+            }
+        }
+        
         ClientInfo info;
         info.clientId = clientId;
-        info.ipAddress = inet_ntoa(addr.sin_addr);
-        info.port = ntohs(addr.sin_port);
-        info.socket = socket;
+        info.ipAddress = inet_ntoa(conn->addr.sin_addr);
+        info.port = ntohs(conn->addr.sin_port);
+        info.socket = conn->socket;
         info.isActive = true;
+        info.subscribed = false;
+        info.resumeToken = newResumeToken();
+        info.conn = conn;
         
         clients[clientId] = info;
+        dropSubscriptions(clientId);
+        updatePresence(info);
         
         cout << "Client registered: " << clientId << " (" << info.ipAddress << ":" << info.port << ")" << endl;
         
         // Send a response to the client that just registered
-        string response = "REGISTERED|" + clientId;
-        send(socket, response.c_str(), response.length(), 0);
+        sendFrame(*conn, encode<Wire::Registered>(clientId), LANE_CONTROL);
+        sendFrame(*conn, encode<Wire::Session>(info.resumeToken), LANE_CONTROL);
         
-        // wait client establish completed
-        this_thread::sleep_for(chrono::milliseconds(500));
         // Notify all other clients about the new client
-        broadcastClientList();
+        publishPresence(clientId);
     }
     
-    void handleSendMessage(const string& data) {
-        // Parse: fromId|toId|message
-        size_t pos1 = data.find('|');
-        size_t pos2 = data.find('|', pos1 + 1);
+    void handleSendMessage(const Wire::SendMsg& msg) {
+        string fromId = msg.fromId.str();
+        string toId = msg.toId.str();
         
-        if (pos1 == string::npos || pos2 == string::npos) return;
-        
-        string fromId = data.substr(0, pos1);
-        string toId = data.substr(pos1 + 1, pos2 - pos1 - 1);
-        string message = data.substr(pos2 + 1);
+        unsigned long long traceId = Tracer::parse(msg.seq.data(), msg.seq.size());
+        long long startUs = traceId ? Tracer::nowUs() : 0;
         
         lock_guard<mutex> lock(clientsMutex);
         
-        if (clients.find(toId) != clients.end() && clients[toId].isActive) {
-            // Forward message to target client
-            string forwardMsg = "MESSAGE|" + fromId + "|" + message;
-            send(clients[toId].socket, forwardMsg.c_str(), forwardMsg.length(), 0);
+        if (traceId) {
+            Tracer::instance().span("server.lock_wait", traceId, startUs, Tracer::nowUs());
+        }
+        
+        // Subscribed senders start watching whoever they message
+        auto sender = clients.find(fromId);
+        if (sender != clients.end() && sender->second.subscribed && sender->second.conn && fromId != toId &&
+            subscribers[toId].insert(fromId).second) {
+            subscriptions[fromId].insert(toId);
+            sendFrame(*sender->second.conn, encode<Wire::Presence>(presenceOf(toId)), LANE_CONTROL);
+        }
+        
+        // Forward message to target client, here or on its node
+        auto recipient = clients.find(toId);
+        string forwardMsg = encode<Wire::Message>(msg.fromId, msg.seq, msg.message);
+        if (recipient != clients.end() && recipient->second.isActive &&
+            deliver(recipient->second, forwardMsg, LANE_BULK)) {
+            if (recipient->second.conn) {
+                noteDelivered(recipient->second, fromId, msg.seq);
+            }
+            if (traceId) {
+                Tracer::instance().span("server.route", traceId, startUs, Tracer::nowUs());
+            }
             
             cout << "Message forwarded from " << fromId << " to " << toId << endl;
         } else {
             // Notify sender that recipient is not available
-            if (clients.find(fromId) != clients.end()) {
-                string errorMsg = "ERROR|Client " + toId + " is not active";
-                send(clients[fromId].socket, errorMsg.c_str(), errorMsg.length(), 0);
+            if (sender != clients.end()) {
+                deliver(sender->second, encode<Wire::Error>("Client " + toId + " is not active", msg.toId, msg.seq),
+                        LANE_CONTROL);
             }
         }
     }
     
-    void handleResult(const string& data) {
-        // Parse: fromId|toId|status
-        size_t pos1 = data.find('|');
-        size_t pos2 = data.find('|', pos1 + 1);
+    void handleResult(const Wire::Result& msg) {
+        string toId = msg.toId.str();
         
-        if (pos1 == string::npos || pos2 == string::npos) return;
+        lock_guard<mutex> lock(clientsMutex);
         
-        string fromId = data.substr(0, pos1);
-        string toId = data.substr(pos1 + 1, pos2 - pos1 - 1);
-        string status = data.substr(pos2 + 1);
+        if (clients.find(toId) != clients.end() && clients[toId].isActive) {
+            string resultMsg = encode<Wire::ResultAck>(msg.fromId, msg.status);
+            deliver(clients[toId], resultMsg, LANE_RECEIPT);
+            
+            cout << "Result sent from " << msg.fromId.str() << " to " << toId << ": " << msg.status.str() << endl;
+        }
+    }
+    
+    void handleResultBatch(const Wire::ResultBatch& msg) {
+        string toId = msg.toId.str();
+        
+        // The trace id, if any, is on lastSeq: firstSeq|lastSeq[:traceId]|status
+        unsigned long long traceId = Tracer::parse(msg.lastSeq.data(), msg.lastSeq.size());
+        long long startUs = traceId ? Tracer::nowUs() : 0;
         
         lock_guard<mutex> lock(clientsMutex);
         
+        if (traceId) {
+            Tracer::instance().span("server.lock_wait", traceId, startUs, Tracer::nowUs());
+        }
+        
+        // Only messages toId actually delivered to the issuer can be receipted
+        auto issuer = clients.find(msg.fromId.str());
+        unsigned long long firstSeq = msg.firstSeq.toNumber();
+        unsigned long long lastSeq = msg.lastSeq.toNumber();
+        unsigned long long delivered = 0;
+        if (issuer != clients.end()) {
+            auto seq = issuer->second.deliveredSeq.find(toId);
+            delivered = (seq != issuer->second.deliveredSeq.end()) ? seq->second : 0;
+        }
+        if (firstSeq == 0 || firstSeq > lastSeq || firstSeq > delivered) {
+            cout << "Dropped result batch from " << msg.fromId.str() << " to " << toId << ": "
+                 << msg.firstSeq.str() << "-" << msg.lastSeq.str() << " was never delivered" << endl;
+            return;
+        }
+        
         if (clients.find(toId) != clients.end() && clients[toId].isActive) {
-            string resultMsg = "RESULT_ACK|" + fromId + "|" + status;
-            send(clients[toId].socket, resultMsg.c_str(), resultMsg.length(), 0);
+            // One frame for the whole range: firstSeq|lastSeq|status
+            string resultMsg = (lastSeq <= delivered)
+                ? encode<Wire::ResultAckBatch>(msg.fromId, firstSeq, msg.lastSeq, msg.status)
+                : encode<Wire::ResultAckBatch>(msg.fromId, firstSeq, delivered, msg.status);
+            deliver(clients[toId], resultMsg, LANE_RECEIPT);
+            
+            if (traceId) {
+                Tracer::instance().span("server.route_receipt", traceId, startUs, Tracer::nowUs());
+            }
             
-            cout << "Result sent from " << fromId << " to " << toId << ": " << status << endl;
+            cout << "Result batch sent from " << msg.fromId.str() << " to " << toId << ": "
+                 << firstSeq << "-" << min(lastSeq, delivered) << " " << msg.status.str() << endl;
         }
     }
     
+    // Remember the highest message seq from fromId handed to a local client.
+    // Called with clientsMutex held.
+    void noteDelivered(ClientInfo& recipient, const string& fromId, StringView seq) {
+        unsigned long& delivered = recipient.deliveredSeq[fromId];
+        delivered = max<unsigned long>(delivered, seq.toNumber());
+    }
+    
     void setClientInactive(const string& clientId) {
         lock_guard<mutex> lock(clientsMutex);
         
-        if (clients.find(clientId) != clients.end()) {
-            clients[clientId].isActive = false;
-            cout << "Client " << clientId << " set to inactive" << endl;
-            
-            // Notify all other clients
-            broadcastClientList();
+        // Clients of other nodes change only through their node's presence
+        if (clients.find(clientId) != clients.end() && clients[clientId].node.empty()) {
+            deactivate(clients[clientId]);
+        }
+    }
+    
+    // Called with clientsMutex held
+    void deactivate(ClientInfo& info) {
+        info.isActive = false;
+        info.resumeToken.clear();
+        updatePresence(info);
+        dropSubscriptions(info.clientId);
+        cout << "Client " << info.clientId << " set to inactive" << endl;
+        
+        // Notify all other clients
+        publishPresence(info.clientId);
+    }
+    
+    // Stop a dropped connection. A client that left without DISCONNECT keeps
+    // its session, still ACTIVE to everyone else: frames for it stay queued
+    // until it resumes or expireSession runs. Returns whether it was kept.
+    bool suspendConnection(const string& clientId, const shared_ptr<Connection>& conn) {
+        lock_guard<mutex> lock(clientsMutex);
+        
+        auto it = clientId.empty() ? clients.end() : clients.find(clientId);
+        bool keep = (it != clients.end() && it->second.isActive && it->second.conn == conn);
+        
+        lock_guard<mutex> sendLock(conn->sendMutex);
+        conn->closing = true;
+        conn->suspended = keep;
+        if (!keep) {
+            conn->lanes.clear();
+        }
+        if (keep) {
+            cout << "Client " << clientId << " dropped, session kept for " << RESUME_GRACE_SEC << "s" << endl;
+        }
+        return keep;
+    }
+    
+    // The client has read this many frames: they will not be needed for a resume
+    void acknowledgeFrames(Connection& conn, unsigned long long framesRead) {
+        lock_guard<mutex> lock(conn.sendMutex);
+        while (!conn.sentLog.empty() && conn.framesWritten - conn.sentLog.size() < framesRead) {
+            conn.sentLogBytes -= conn.sentLog.front().second.length();
+            conn.sentLog.pop_front();
+        }
+    }
+    
+    // The grace period is over: unless the client resumed meanwhile it is gone
+    void expireSession(const string& clientId, const shared_ptr<Connection>& conn) {
+        lock_guard<mutex> lock(clientsMutex);
+        
+        auto it = clients.find(clientId);
+        if (it == clients.end() || it->second.conn != conn || !it->second.isActive) {
+            return;
+        }
+        {
+            lock_guard<mutex> sendLock(conn->sendMutex);
+            conn->suspended = false;
+            conn->sentLog.clear();
+            conn->sentLogBytes = 0;
+        }
+        failQueuedMessages(*conn, clientId);
+        deactivate(it->second);
+    }
+    
+    // Drop what is still queued for a client whose session ended, telling the
+    // sender of each message that it was not delivered.
+    // Called with clientsMutex held.
+    void failQueuedMessages(Connection& conn, const string& clientId) {
+        vector<string> queued;
+        {
+            lock_guard<mutex> sendLock(conn.sendMutex);
+            string frame;
+            Lane lane;
+            long long waitUs;
+            while (conn.lanes.pop(frame, lane, waitUs)) {
+                queued.push_back(frame);
+            }
+        }
+        
+        for (const string& frame : queued) {
+            // Queued frames end with FRAME_END
+            Frame decoded;
+            if (!decodeFrame(StringView(frame.data(), frame.length() - 1), decoded) ||
+                decoded.opcode != OP_MESSAGE) {
+                continue;
+            }
+            Wire::Message message = decoded.as<Wire::Message>();
+            auto sender = clients.find(message.fromId.str());
+            if (sender != clients.end() && sender->second.isActive) {
+                deliver(sender->second, encode<Wire::Error>("Client " + clientId + " is not active", clientId,
+                                                            message.seq), LANE_CONTROL);
+            }
+        }
+    }
+    
+    void handleResume(const shared_ptr<Connection>& conn, const Wire::Resume& msg, string& clientId) {
+        // framesRead - session frames the client read before the drop
+        string id = msg.clientId.str();
+        unsigned long long received = msg.framesRead.toNumber();
+        
+        lock_guard<mutex> lock(clientsMutex);
+        
+        auto it = clients.find(id);
+        if (it == clients.end() || !it->second.isActive || it->second.resumeToken.empty() ||
+            it->second.resumeToken != msg.token) {
+            rejectResume(*conn, id, "unknown or expired session");
+            return;
+        }
+        if (!it->second.conn || it->second.conn == conn) {
+            rejectResume(*conn, id, "session is not on another connection");
+            return;
+        }
+        
+        // One connection's sendMutex at a time: nothing can be queued on the
+        // new connection before it replaces the old one under clientsMutex
+        shared_ptr<Connection> old = it->second.conn;
+        unique_lock<mutex> oldLock(old->sendMutex);
+        
+        if (received > old->framesWritten || old->framesWritten - received > old->sentLog.size()) {
+            oldLock.unlock();
+            rejectResume(*conn, id, "missed frames are no longer buffered");
+            return;
+        }
+        
+        // The old connection may still look alive (half-open): stop its reader
+        if (!old->closing) {
+            shutdown(old->socket, SHUT_RDWR);
+        }
+        
+        // The session goes on from what each side read: the frames the client
+        // missed are written again under their numbers, then what was never
+        // sent. Frames about the old connection itself are dropped.
+        unsigned long long missed = old->framesWritten - received;
+        deque<pair<Lane, string>> replay(old->sentLog.end() - missed, old->sentLog.end());
+        string frame;
+        Lane lane;
+        long long waitUs;
+        while (old->lanes.pop(frame, lane, waitUs)) {
+            if (isSessionFrame(frame)) {
+                replay.push_back(make_pair(lane, frame));
+            }
+        }
+        unsigned long long processed = old->framesReceived;
+        
+        old->closing = true;
+        old->suspended = false;
+        old->sentLog.clear();
+        old->sentLogBytes = 0;
+        old->sendReady.notify_one();
+        oldLock.unlock();
+        
+        // RESUMED acknowledges what was read. This runs on the new connection's
+        // reader, the only one to count on it.
+        conn->framesReceived = processed;
+        conn->framesAcked = processed;
+        {
+            lock_guard<mutex> sendLock(conn->sendMutex);
+            conn->framesWritten = received;
+            conn->lanes.push(encode<Wire::Resumed>(id, processed) + FRAME_END, LANE_CONTROL);
+            for (const auto& queued : replay) {
+                conn->lanes.push(queued.second, queued.first);
+            }
+        }
+        conn->sendReady.notify_one();
+        
+        it->second.conn = conn;
+        it->second.socket = conn->socket;
+        it->second.ipAddress = inet_ntoa(conn->addr.sin_addr);
+        it->second.port = ntohs(conn->addr.sin_port);
+        clientId = id;
+        
+        cout << "Client resumed: " << id << " (" << missed << " frames replayed, "
+             << processed << " frames read)" << endl;
+    }
+    
+    // The client registers again on this connection; it resends nothing
+    void rejectResume(Connection& conn, const string& clientId, const string& reason) {
+        sendFrame(conn, encode<Wire::ResumeFailed>(reason), LANE_CONTROL);
+        cout << "Resume failed for " << clientId << ": " << reason << endl;
+    }
+    
+    // Called with clientsMutex held
+    string newResumeToken() {
+        char token[17];
+        snprintf(token, sizeof(token), "%016llx", static_cast<unsigned long long>(tokenGenerator()));
+        return token;
+    }
+    
+    void handleSubscribe(const string& subscriberId, StringView clientIds, bool subscribe) {
+        // clientId|clientId|... (may be empty: subscribe to nobody yet)
+        lock_guard<mutex> lock(clientsMutex);
+        
+        auto subscriber = clients.find(subscriberId);
+        if (subscriber == clients.end() || !subscriber->second.isActive) return;
+        
+        // From now on this client only hears about the clients it watches
+        subscriber->second.subscribed = true;
+        
+        // Reply with the current status of every newly watched client
+        string reply = encode<Wire::Presence>();
+        size_t replied = 0;
+        StringView item;
+        for (FieldIterator it(clientIds); it.next(item);) {
+            string watchedId = item.str();
+            if (watchedId.empty() || watchedId == subscriberId) {
+                continue;
+            }
+            if (subscribe) {
+                if (subscribers[watchedId].insert(subscriberId).second) {
+                    subscriptions[subscriberId].insert(watchedId);
+                    appendField(reply, presenceOf(watchedId));
+                    ++replied;
+                }
+            } else {
+                unsubscribe(subscriberId, watchedId);
+            }
+        }
+        
+        if (replied > 0) {
+            sendFrame(*subscriber->second.conn, reply, LANE_CONTROL);
         }
+        cout << "Client " << subscriberId << " watches " << subscriptions[subscriberId].size() << " clients" << endl;
     }
     
-    void broadcastClientList() {
-        string clientList = CLIENT_LIST;
+    // "clientId:STATUS" as in CLIENT_LIST; unknown clients are INACTIVE.
+    // Called with clientsMutex held.
+    string presenceOf(const string& clientId) {
+        auto it = clients.find(clientId);
+        bool active = (it != clients.end() && it->second.isActive);
+        return clientId + ":" + (active ? "ACTIVE" : "INACTIVE");
+    }
+    
+    // Called with clientsMutex held
+    void unsubscribe(const string& subscriberId, const string& watchedId) {
+        auto watchers = subscribers.find(watchedId);
+        if (watchers != subscribers.end()) {
+            watchers->second.erase(subscriberId);
+            if (watchers->second.empty()) {
+                subscribers.erase(watchers);
+            }
+        }
+        
+        auto watched = subscriptions.find(subscriberId);
+        if (watched != subscriptions.end()) {
+            watched->second.erase(watchedId);
+            if (watched->second.empty()) {
+                subscriptions.erase(watched);
+            }
+        }
+    }
+    
+    // Forget everything a client watches; it subscribes again after registering.
+    // Called with clientsMutex held.
+    void dropSubscriptions(const string& subscriberId) {
+        auto watched = subscriptions.find(subscriberId);
+        if (watched == subscriptions.end()) {
+            return;
+        }
+        
+        set<string> watchedIds = watched->second;
+        for (const string& watchedId : watchedIds) {
+            unsubscribe(subscriberId, watchedId);
+        }
+    }
+    
+    // Tell interested clients that one client's status changed: its subscribers
+    // get a PRESENCE delta, clients that never subscribed the whole CLIENT_LIST.
+    // Called with clientsMutex held.
+    void publishPresence(const string& changedId) {
+        auto changed = clients.find(changedId);
+        if (changed != clients.end() && changed->second.node.empty()) {
+            gossipPresence(changedId);
+        }
+        
+        unsigned long long deltas = 0;
+        auto watchers = subscribers.find(changedId);
+        if (watchers != subscribers.end()) {
+            string delta = encode<Wire::Presence>(presenceOf(changedId));
+            for (const string& subscriberId : watchers->second) {
+                auto it = clients.find(subscriberId);
+                if (it != clients.end() && it->second.isActive && it->second.conn &&
+                    sendFrame(*it->second.conn, delta, LANE_CONTROL)) {
+                    ++deltas;
+                }
+            }
+        }
+        
+        unsigned long long broadcasts = broadcastClientList();
+        
+        unsigned long long fanOut = deltas + broadcasts;
+        presenceChanges++;
+        presenceDeltas += deltas;
+        presenceBroadcasts += broadcasts;
+        unsigned long long max = presenceMaxFanOut.load();
+        while (fanOut > max && !presenceMaxFanOut.compare_exchange_weak(max, fanOut)) {
+        }
+    }
+    
+    // Send the whole list to the active clients without subscriptions, return how many
+    unsigned long long broadcastClientList() {
+        shared_ptr<const string> clientList;
+        unsigned long long sent = 0;
         
         for (const auto& pair : clients) {
-            clientList += "|" + pair.second.clientId + ":" + 
-                         (pair.second.isActive ? "ACTIVE" : "INACTIVE");
+            if (pair.second.isActive && !pair.second.subscribed && pair.second.conn) {
+                if (!clientList) {
+                    clientList = encodeClientList(*currentPresence());
+                }
+                sent += sendFrame(*pair.second.conn, *clientList, LANE_CONTROL) ? 1 : 0;
+            }
+        }
+        
+        if (sent) {
+            cout << "Broadcasting client list to " << sent << " unsubscribed clients" << endl;
+        }
+        return sent;
+    }
+    
+    // Queue a frame for a client, on its own connection or through the link
+    // to the node it is connected to. Called with clientsMutex held.
+    bool deliver(const ClientInfo& info, const string& frame, Lane lane) {
+        if (info.conn) {
+            return sendFrame(*info.conn, frame, lane);
+        }
+        
+        auto link = peerLinks.find(info.node);
+        if (link == peerLinks.end()) {
+            return false;
         }
+        ++forwardedFrames;
+        // Same lane on the link, so that presence and receipts overtake bulk there too
+        return sendFrame(*link->second, encode<Wire::NodeDeliver>(info.clientId, lane, frame), lane);
+    }
+    
+    // Keep an outbound link to one peer: announce this node and, once the
+    // peer has answered with its NODE_HELLO, the presence of its clients,
+    // then forward frames until the link drops; redial after PEER_RETRY_MS.
+    // The peer writes nothing else on this link.
+    void peerLoop(string address) {
+        size_t colon = address.rfind(':');
+        string host = address.substr(0, colon);
+        string service = (colon == string::npos) ? to_string(SERVER_DEFAULT) : address.substr(colon + 1);
         
-        cout << "Broadcasting client list to all active clients" << endl;
+        while (true) {
+            int sock = -1;
+            addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* result = nullptr;
+            if (getaddrinfo(host.c_str(), service.c_str(), &hints, &result) == 0) {
+                sock = socket(AF_INET, SOCK_STREAM, 0);
+                if (sock >= 0 && ::connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
+                    close(sock);
+                    sock = -1;
+                }
+            }
+            
+            if (sock < 0) {
+                if (result) {
+                    freeaddrinfo(result);
+                }
+                this_thread::sleep_for(chrono::milliseconds(PEER_RETRY_MS));
+                continue;
+            }
+            
+            int opt = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            
+            shared_ptr<Connection> link = make_shared<Connection>();
+            link->id = nextConnectionId++;
+            link->socket = sock;
+            memcpy(&link->addr, result->ai_addr, sizeof(link->addr));
+            link->peerNode = address;
+            freeaddrinfo(result);
+            
+            thread writer(&ChatServer::writeLoop, this, link);
+            sendFrame(*link, encode<Wire::NodeHello>(nodeId, clusterKey), LANE_CONTROL);
+            
+            // Forward under the id the peer records its clients' presence with
+            string peer = awaitNodeHello(sock);
+            if (!peer.empty()) {
+                lock_guard<mutex> lock(clientsMutex);
+                {
+                    lock_guard<mutex> sendLock(link->sendMutex);
+                    link->peerNode = peer;
+                }
+                sendFrame(*link, encodeNodePresence(), LANE_CONTROL);
+                peerLinks[peer] = link;
+            }
+            
+            if (peer.empty()) {
+                cout << "Node at " << address << " refused the link" << endl;
+            } else {
+                cout << "Linked to node " << peer << " at " << address << endl;
+                char buffer[256];
+                while (recv(sock, buffer, sizeof(buffer), 0) > 0) {
+                }
+            }
+            
+            // Frames still queued on the link are lost with it
+            {
+                lock_guard<mutex> lock(clientsMutex);
+                auto current = peerLinks.find(peer);
+                if (current != peerLinks.end() && current->second == link) {
+                    peerLinks.erase(current);
+                }
+                lock_guard<mutex> sendLock(link->sendMutex);
+                link->closing = true;
+                link->lanes.clear();
+            }
+            link->sendReady.notify_one();
+            shutdown(sock, SHUT_RDWR);
+            writer.join();
+            close(sock);
+            
+            if (!peer.empty()) {
+                cout << "Lost link to node " << peer << endl;
+            }
+            this_thread::sleep_for(chrono::milliseconds(PEER_RETRY_MS));
+        }
+    }
+    
+    // The peer's answer on an outbound link: its node id, or empty if the
+    // link was refused, closed or answered with anything else
+    string awaitNodeHello(int sock) {
+        string pending;
+        char buffer[256];
+        size_t end;
+        while ((end = pending.find(FRAME_END)) == string::npos) {
+            ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+            if (n <= 0 || pending.length() > 4096) {
+                return "";
+            }
+            pending.append(buffer, n);
+        }
         
+        Frame frame;
+        if (!decodeFrame(StringView(pending.data(), end), frame) || frame.opcode != OP_NODE_HELLO) {
+            return "";
+        }
+        Wire::NodeHello hello = frame.as<Wire::NodeHello>();
+        return (hello.clusterKey == clusterKey) ? hello.nodeId.str() : "";
+    }
+    
+    // NODE_HELLO turns a connection into a peer's link: only as its first
+    // frame, no client on it, and only from a node presenting the cluster key. The answer is
+    // this node's own NODE_HELLO, whose id the peer forwards frames under.
+    void acceptNodeLink(const shared_ptr<Connection>& conn, const Wire::NodeHello& msg, const string& clientId) {
+        string node = msg.nodeId.str();
+        if (!clientId.empty() || conn->framesReceived != 1 || clusterKey.empty() || msg.clusterKey != clusterKey ||
+            node.empty() || node.find('|') != string::npos) {
+            sendFrame(*conn, encode<Wire::Error>("Node link refused"), LANE_CONTROL);
+            cout << "Refused node link on connection " << conn->id << endl;
+            return;
+        }
+        
+        lock_guard<mutex> lock(clientsMutex);
+        {
+            lock_guard<mutex> sendLock(conn->sendMutex);
+            conn->peerNode = node;
+        }
+        peerInbound[node] = conn;
+        sendFrame(*conn, encode<Wire::NodeHello>(nodeId, clusterKey), LANE_CONTROL);
+        cout << "Node " << node << " linked" << endl;
+    }
+    
+    // Frames arriving on a peer's link
+    void processPeerMessage(Connection& conn, const Frame& frame) {
+        switch (frame.opcode) {
+        case OP_NODE_PRESENCE:
+            applyNodePresence(conn.peerNode, frame.as<Wire::NodePresence>().entries);
+            break;
+        case OP_NODE_DELIVER:
+            handleNodeDeliver(frame.as<Wire::NodeDeliver>());
+            break;
+        default:
+            break;
+        }
+    }
+    
+    // NODE_PRESENCE|nodeId|id:STATUS|... for every client of this node.
+    // Called with clientsMutex held.
+    string encodeNodePresence() {
+        string frame = encode<Wire::NodePresence>(nodeId);
         for (const auto& pair : clients) {
-            if (pair.second.isActive) {
-                send(pair.second.socket, clientList.c_str(), clientList.length(), 0);
+            if (pair.second.node.empty()) {
+                appendField(frame, presenceOf(pair.first));
+            }
+        }
+        return frame;
+    }
+    
+    // Tell every peer that one of this node's clients changed status.
+    // Called with clientsMutex held.
+    void gossipPresence(const string& clientId) {
+        if (peerLinks.empty()) {
+            return;
+        }
+        string frame = encode<Wire::NodePresence>(nodeId, presenceOf(clientId));
+        for (const auto& pair : peerLinks) {
+            sendFrame(*pair.second, frame, LANE_CONTROL);
+        }
+    }
+    
+    void applyNodePresence(const string& peer, StringView entries) {
+        // id:STATUS|... (the frame's node id is the link's, repeated for readability)
+        lock_guard<mutex> lock(clientsMutex);
+        
+        StringView entry;
+        for (FieldIterator entryIt(entries); entryIt.next(entry);) {
+            size_t colon = entry.find(':');
+            if (colon == StringView::npos) {
+                continue;
+            }
+            string id = entry.substr(0, colon).str();
+            bool active = (entry.substr(colon + 1) == "ACTIVE");
+            
+            // A client connected here wins over the same id on another node
+            auto it = clients.find(id);
+            if (it != clients.end() && it->second.conn && it->second.isActive) {
+                continue;
+            }
+            if (it != clients.end() && it->second.node == peer && it->second.isActive == active) {
+                continue;
+            }
+            
+            ClientInfo& info = clients[id];
+            info.clientId = id;
+            info.ipAddress.clear();
+            info.port = 0;
+            info.socket = -1;
+            info.isActive = active;
+            info.subscribed = false;
+            info.resumeToken.clear();
+            info.node = peer;
+            info.conn.reset();
+            
+            updatePresence(info);
+            publishPresence(id);
+        }
+    }
+    
+    void handleNodeDeliver(const Wire::NodeDeliver& msg) {
+        string toId = msg.clientId.str();
+        unsigned long long lane = msg.lane.toNumber();
+        if (lane >= LANE_COUNT) return;
+        
+        lock_guard<mutex> lock(clientsMutex);
+        
+        Frame inner;
+        bool isMessage = decodeFrame(msg.frame, inner) && inner.opcode == OP_MESSAGE;
+        Wire::Message message = inner.as<Wire::Message>();
+        
+        auto it = clients.find(toId);
+        if (it != clients.end() && it->second.isActive && it->second.conn &&
+            sendFrame(*it->second.conn, msg.frame.str(), static_cast<Lane>(lane))) {
+            ++peerFrames;
+            
+            // Receipts for forwarded messages are checked here, at the recipient's node
+            if (isMessage) {
+                noteDelivered(it->second, message.fromId.str(), message.seq);
+            }
+            return;
+        }
+        
+        cout << "Dropped frame forwarded for inactive client " << toId << endl;
+        // The recipient went away after its node last gossiped: tell the
+        // sender, wherever it is, as for a local recipient
+        if (isMessage) {
+            auto sender = clients.find(message.fromId.str());
+            if (sender != clients.end() && sender->second.isActive) {
+                deliver(sender->second, encode<Wire::Error>("Client " + toId + " is not active", toId, message.seq),
+                        LANE_CONTROL);
+            }
+        }
+    }
+    
+    // A peer's link dropped: its clients are unreachable until it links again
+    void nodeDown(const string& peer, const shared_ptr<Connection>& conn) {
+        lock_guard<mutex> lock(clientsMutex);
+        
+        auto link = peerInbound.find(peer);
+        if (link == peerInbound.end() || link->second != conn) {
+            return; // already replaced by a newer link
+        }
+        peerInbound.erase(link);
+        cout << "Node " << peer << " unlinked" << endl;
+        
+        for (auto& pair : clients) {
+            if (pair.second.node == peer && pair.second.isActive) {
+                pair.second.isActive = false;
+                updatePresence(pair.second);
+                publishPresence(pair.first);
+            }
+        }
+    }
+    
+    void handleGetListId(Connection& conn, const Wire::GetListId& msg) {
+        // Every field is optional
+        size_t offset = msg.offset.toNumber();
+        size_t limit = msg.limit.toNumber();
+        string prefix = msg.prefix.str();
+        if (limit == 0 || limit > GETLISTID_MAX_PAGE) {
+            limit = GETLISTID_MAX_PAGE;
+        }
+        
+        // Served from the snapshot only, never takes clientsMutex
+        shared_ptr<const PresenceSnapshot> snapshot = currentPresence();
+        sendFrame(conn, *encodeClientListPage(*snapshot, offset, limit, prefix), LANE_CONTROL);
+    }
+    
+    // Record one client's status in the live roster.
+    // Called with clientsMutex held.
+    void updatePresence(const ClientInfo& info) {
+        shared_ptr<PresenceEntry> entry = make_shared<PresenceEntry>();
+        entry->clientId = info.clientId;
+        entry->encoded = info.clientId + ":" + (info.isActive ? "ACTIVE" : "INACTIVE");
+        
+        lock_guard<mutex> lock(presenceMutex);
+        presenceEntries[info.clientId] = entry;
+        ++presenceVersion;
+    }
+    
+    // Snapshot of the live roster, rebuilt once per version by the first
+    // query that needs it
+    shared_ptr<const PresenceSnapshot> currentPresence() {
+        shared_ptr<const PresenceSnapshot> snapshot = atomic_load(&presence);
+        if (snapshot->version == presenceVersion.load()) {
+            return snapshot;
+        }
+        
+        lock_guard<mutex> lock(presenceMutex);
+        snapshot = atomic_load(&presence);
+        if (snapshot->version == presenceVersion.load()) {
+            return snapshot; // rebuilt by another query meanwhile
+        }
+        
+        shared_ptr<PresenceSnapshot> next = make_shared<PresenceSnapshot>();
+        next->version = presenceVersion.load();
+        next->entries.reserve(presenceEntries.size());
+        for (const auto& pair : presenceEntries) {
+            next->entries.push_back(pair.second);
+        }
+        
+        shared_ptr<const PresenceSnapshot> published = next;
+        atomic_store(&presence, published);
+        return published;
+    }
+    
+    // CLIENT_LIST|id:STATUS|... for the whole roster, encoded once per version
+    shared_ptr<const string> encodeClientList(const PresenceSnapshot& snapshot) {
+        return cachedEncoding(snapshot, "", [&snapshot]() {
+            string clientList = encode<Wire::ClientList>();
+            for (const auto& entry : snapshot.entries) {
+                appendField(clientList, entry->encoded);
             }
+            return clientList;
+        });
+    }
+    
+    // CLIENT_LIST_PAGE|version|offset|total|id:STATUS|... for clients matching prefix
+    shared_ptr<const string> encodeClientListPage(const PresenceSnapshot& snapshot, size_t offset,
+                                                  size_t limit, const string& prefix) {
+        string key = to_string(offset) + "|" + to_string(limit) + "|" + prefix;
+        return cachedEncoding(snapshot, key, [&]() {
+            auto first = lower_bound(snapshot.entries.begin(), snapshot.entries.end(), prefix,
+                [](const shared_ptr<const PresenceEntry>& e, const string& p) { return e->clientId < p; });
+            
+            string page;
+            size_t total = 0;
+            for (auto it = first; it != snapshot.entries.end(); ++it) {
+                if ((*it)->clientId.compare(0, prefix.length(), prefix) != 0) {
+                    break;
+                }
+                if (total >= offset && total - offset < limit) {
+                    appendField(page, (*it)->encoded);
+                }
+                ++total;
+            }
+            
+            return encode<Wire::ClientListPage>(snapshot.version, offset, total) + page;
+        });
+    }
+    
+    template <typename Encoder>
+    shared_ptr<const string> cachedEncoding(const PresenceSnapshot& snapshot, const string& key, Encoder encode) {
+        {
+            lock_guard<mutex> lock(snapshot.cacheMutex);
+            auto it = snapshot.encoded.find(key);
+            if (it != snapshot.encoded.end()) {
+                return it->second;
+            }
+        }
+        
+        shared_ptr<const string> frame = make_shared<string>(encode());
+        
+        lock_guard<mutex> lock(snapshot.cacheMutex);
+        if (snapshot.encoded.size() >= PRESENCE_CACHE_MAX) {
+            snapshot.encoded.clear();
         }
+        snapshot.encoded[key] = frame;
+        return frame;
     }
 };
 
 int main(int argc, char* argv[]) {
     int port = 8080;
+    string captureFile;
+    string node;
+    string clusterKey;
+    vector<string> peers;
     
-    if (argc > 1) {
-        port = atoi(argv[1]);
+    // server [port] [captureFile] [--node id] [--peers host:port,...] [--cluster-key key]
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--node" && i + 1 < argc) {
+            node = argv[++i];
+        } else if (arg == "--cluster-key" && i + 1 < argc) {
+            clusterKey = argv[++i];
+        } else if (arg == "--peers" && i + 1 < argc) {
+            string list = argv[++i];
+            size_t start = 0;
+            while (start < list.length()) {
+                size_t end = list.find(',', start);
+                if (end == string::npos) {
+                    end = list.length();
+                }
+                if (end > start) {
+                    peers.push_back(list.substr(start, end - start));
+                }
+                start = end + 1;
+            }
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() > 0) {
+        port = atoi(positional[0].c_str());
+    }
+    if (positional.size() > 1) {
+        captureFile = positional[1];
     }
     
+    // SIGINT and SIGTERM are blocked before any thread starts, so that only
+    // waitForStop receives them
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+    
+    Tracer::instance().init("server");
+    
     ChatServer server(port);
     
+    // Optional: record inbound frames for chat_replay
+    if (!captureFile.empty() && !server.startCapture(captureFile)) {
+        return 1;
+    }
+    
     if (!server.start()) {
         return 1;
     }
     
+    // Optional: join a cluster. Every node dials the others' addresses and
+    // links under the id each answers with (--node, default 127.0.0.1:<port>);
+    // all nodes must share the --cluster-key
+    if (!peers.empty() && clusterKey.empty()) {
+        cerr << "--peers needs a --cluster-key" << endl;
+        return 1;
+    }
+    if (!node.empty()) {
+        server.setNodeId(node);
+    }
+    server.setClusterKey(clusterKey);
+    for (const string& peer : peers) {
+        server.addPeer(peer);
+    }
+    
+    thread(&ChatServer::waitForStop, &server, stopSignals).detach();
+    thread(&ChatServer::reportStats, &server).detach();
     server.acceptConnections();
     
     return 0;
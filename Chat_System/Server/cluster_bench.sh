@@ -0,0 +1,42 @@
+#!/bin/sh
+# Run chat_bench against clusters of 1..N nodes on localhost, each a full
+# mesh of ./server processes on consecutive ports.
+#
+# Usage: ./cluster_bench.sh [maxNodes] [clients] [messagesPerClient] [basePort]
+
+MAX_NODES=${1:-3}
+CLIENTS=${2:-12}
+MESSAGES=${3:-2000}
+BASE_PORT=${4:-9100}
+
+PIDS=""
+stop_nodes() {
+    [ -n "$PIDS" ] && kill $PIDS 2>/dev/null && wait $PIDS 2>/dev/null
+    PIDS=""
+}
+trap stop_nodes EXIT INT TERM
+
+nodes=1
+while [ $nodes -le $MAX_NODES ]; do
+    addresses=""
+    i=0
+    while [ $i -lt $nodes ]; do
+        addresses="$addresses 127.0.0.1:$((BASE_PORT + i))"
+        i=$((i + 1))
+    done
+
+    for self in $addresses; do
+        peers=$(echo $addresses | tr ' ' '\n' | grep -vx "$self" | paste -sd, -)
+        ./server "${self##*:}" --node "$self" --cluster-key bench ${peers:+--peers "$peers"} >/dev/null 2>&1 &
+        PIDS="$PIDS $!"
+    done
+    # Let the nodes listen and link up
+    sleep 2
+
+    echo "=== $nodes node(s)"
+    ./chat_bench "$CLIENTS" "$MESSAGES" $addresses | grep -E "remote|delivered|throughput|p99"
+
+    stop_nodes
+    BASE_PORT=$((BASE_PORT + nodes))
+    nodes=$((nodes + 1))
+done
@@ -1,20 +1,16 @@
 #ifndef CHAT_CLIENT_LIB_H
 #define CHAT_CLIENT_LIB_H
 
-namespace CHAT_SYSTEM {
+// Command names, message fields and framing
+#include "ChatProtocol.h"
 
-#define REGISTER "REGISTER"
-#define REGISTERD "REGISTERD"
-#define SEND_MSG "SEND_MSG"
-#define RESULT  "RESULT"
-#define DISCONNECT "DISCONNECT"
-#define MESSAGE "MESSAGE"
-#define RESULT_ACK "RESULT_ACK"
-#define CLIENT_LIST "CLIENT_LIST"
-#define GETLISTID "GETLISTID"
+namespace CHAT_SYSTEM {
 
 #define SERVER_DEFAULT 8080
 
+// Largest page returned for one GETLISTID query
+#define GETLISTID_MAX_PAGE 256
+
 #ifdef IP_DETAIL
 #define IP_SERVER "1.1.1.1" //don't used, because user INADDR_ANY 
 #endif
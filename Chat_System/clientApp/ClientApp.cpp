@@ -1,6 +1,8 @@
 #include "ChatClientLib.h"
 #include <iostream>
 #include <string>
+#include <vector>
+#include <sstream>
 #include <thread>
 #include <chrono>
 
@@ -11,7 +13,6 @@ class MyClientApp : public IChatClientObserver {
 private:
     IChatClient* chatClient;
     string myClientId;
-    vector<ClientInfo> m_clients;
     string m_currentUser = "";
 public:
     MyClientApp(string& currentUser) : chatClient(nullptr) {
@@ -45,6 +46,16 @@ public:
         cout << "\nEnter command: " << flush;
     }
     
+    void onResultsReceived(const string& fromClientId, unsigned long firstSeq,
+                           unsigned long lastSeq, const string& result) override {
+        cout << "\n[RESULT] From: " << fromClientId << " - Messages #" << firstSeq;
+        if (lastSeq != firstSeq) {
+            cout << "-#" << lastSeq;
+        }
+        cout << " - Status: " << result << endl;
+        cout << "\nEnter command: " << flush;
+    }
+    
     void onConnected() override {
         cout << "\nSuccessfully connected to server!" << endl;
         cout << "Client ID: " << chatClient->getClientId() << endl;
@@ -55,13 +66,28 @@ public:
         cout << "\n⚠ Disconnected from server" << endl;
     }
     
+    void onReconnected(bool resumed) override {
+        cout << "\nReconnected to server" << (resumed ? "" : " (new session, messages may have been missed)") << endl;
+        cout << "\nEnter command: " << flush;
+    }
+    
     void onClientListUpdated(const vector<ClientInfo>& clients) override {
         cout << "\n[CLIENT LIST UPDATE]" << endl;
-        m_clients = clients;
         showListUserStatus(clients);
         cout << "\nEnter command: " << flush;
     }
     
+    void onClientListPage(unsigned long version, size_t offset, size_t total,
+                          const vector<ClientInfo>& clients) override {
+        cout << "\n[CLIENT LIST] " << offset + 1 << "-" << offset + clients.size()
+             << " of " << total << " (version " << version << ")" << endl;
+        for (const auto& client : clients) {
+            string status = client.isActive ? "ACTIVE" : "INACTIVE";
+            cout << "   " << status << " - " << client.clientId << endl;
+        }
+        cout << "\nEnter command: " << flush;
+    }
+    
     void onError(const string& errorMessage) override {
         cout << "\n[ERROR] " << errorMessage << endl;
         cout << "\nEnter command: " << flush;
@@ -109,7 +135,7 @@ public:
         string command;
         while (isConnected()) {
             printHelp();
-            showListUserStatus(m_clients);
+            showListUserStatus(chatClient->getClientListSnapshot()->clients);
             cout << "\nEnter command: ";
             getline(cin, command);
             
@@ -127,6 +153,9 @@ private:
         cout << "║         Chat Client Commands           ║" << endl;
         cout << "╠════════════════════════════════════════╣" << endl;
         cout << "║ send <id> <msg>  - Send message        ║" << endl;
+        cout << "║ list [prefix]    - Query client list   ║" << endl;
+        cout << "║ stats            - Send queue latency  ║" << endl;
+        cout << "║ watch [ids...]   - Presence of ids only║" << endl;
         cout << "║ help             - Show this help      ║" << endl;
         cout << "║ quit             - Disconnect & exit   ║" << endl;
         cout << "╚════════════════════════════════════════╝" << endl;
@@ -143,6 +172,27 @@ private:
         else if (command.substr(0, 4) == "send") {
             handleSendCommand(command);
         }
+        else if (command == "stats") {
+            for (const auto& lane : chatClient->getOutboundStats()) {
+                cout << "   " << lane.lane << ": " << lane.frames << " frames, avg "
+                     << lane.avgWaitUs << "us, max " << lane.maxWaitUs << "us" << endl;
+            }
+        }
+        else if (command.substr(0, 5) == "watch") {
+            // watch [id id ...]
+            istringstream ids(command.substr(5));
+            vector<string> clientIds;
+            string id;
+            while (ids >> id) {
+                clientIds.push_back(id);
+            }
+            chatClient->subscribePresence(clientIds);
+        }
+        else if (command.substr(0, 4) == "list") {
+            // list [prefix]
+            string prefix = command.length() > 5 ? command.substr(5) : "";
+            chatClient->requestClientList(prefix, 0, 0);
+        }
         else {
             cout << "Unknown command. Type 'help' for available commands." << endl;
         }
@@ -0,0 +1,519 @@
+#ifndef CHAT_CLIENT_CORO_H
+#define CHAT_CLIENT_CORO_H
+
+// Optional C++20 coroutine layer over IPollingChatClient. Header only: the
+// shared library itself stays C++11, applications that include this header
+// build with -std=c++20.
+//
+//   coro::Task<void> chat(coro::Client* alice) {
+//       if (!co_await alice->connect("Alice", "127.0.0.1", 8080)) co_return;
+//       std::string result = co_await alice->send("Bob", "hi");   // "OK" once delivered
+//       while (auto msg = co_await alice->nextMessage()) { ... }
+//   }
+//
+//   coro::Scheduler scheduler;
+//   coro::Client alice(scheduler);
+//   scheduler.spawn(chat(&alice));
+//   scheduler.run();
+//
+// Everything runs on the thread that calls Scheduler::run(): one thread can
+// drive any number of Clients and Tasks.
+//
+// Pass state to spawned coroutines as parameters: a capturing lambda that is
+// itself the coroutine is destroyed before the coroutine body runs.
+
+#if __cplusplus < 202002L
+#error "ChatClientCoro.h requires C++20 (-std=c++20)"
+#endif
+
+#include "ChatClientLib.h"
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <deque>
+#include <map>
+#include <queue>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <poll.h>
+
+namespace CHAT_SYSTEM {
+namespace coro {
+
+template <typename T> class Task;
+
+namespace detail {
+
+// Resumes whoever awaited the task once it finishes
+struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+        std::coroutine_handle<> next = h.promise().continuation;
+        return next ? next : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+    T result() {
+        if (exception) std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+}
+
+// Lazily started coroutine returning T; start it by co_await or Scheduler::spawn
+template <typename T>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+}
+
+class Client;
+
+// Single-threaded event loop: ready coroutines, timers and the sockets of
+// every registered Client
+class Scheduler {
+public:
+    // Start a task; the scheduler keeps it alive until it completes
+    void spawn(Task<void> task) {
+        ++liveTasks;
+        runDetached(std::move(task), this);
+    }
+
+    // Resume a coroutine on the next loop iteration
+    void post(std::coroutine_handle<> h) {
+        ready.push_back(h);
+    }
+
+    // co_await scheduler.sleep(ms)
+    auto sleep(int ms) {
+        struct Awaiter {
+            Scheduler* scheduler;
+            std::chrono::steady_clock::time_point deadline;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { scheduler->timers.push(Timer{deadline, h}); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{this, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms)};
+    }
+
+    // Run until every spawned task has completed (or stop() is called)
+    void run();
+
+    void stop() {
+        stopped = true;
+    }
+
+private:
+    friend class Client;
+
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        std::coroutine_handle<> handle;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+
+    // Fire-and-forget wrapper that owns a spawned Task
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+    };
+
+    static Detached runDetached(Task<void> task, Scheduler* scheduler) {
+        co_await task;
+        --scheduler->liveTasks;
+    }
+
+    std::deque<std::coroutine_handle<>> ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::vector<Client*> clients;
+    size_t liveTasks = 0;
+    bool stopped = false;
+};
+
+// Values pushed by callbacks and pulled by one coroutine with co_await next();
+// next() yields std::nullopt once the stream is closed and drained
+template <typename T>
+class AsyncStream {
+public:
+    explicit AsyncStream(Scheduler& s) : scheduler(s) {}
+
+    void push(T value) {
+        items.push_back(std::move(value));
+        wake();
+    }
+
+    void close() {
+        closed = true;
+        wake();
+    }
+
+    void reopen() {
+        closed = false;
+    }
+
+    auto next() {
+        struct Awaiter {
+            AsyncStream* stream;
+            bool await_ready() const noexcept { return !stream->items.empty() || stream->closed; }
+            void await_suspend(std::coroutine_handle<> h) { stream->waiter = h; }
+            std::optional<T> await_resume() {
+                if (stream->items.empty()) return std::nullopt;
+                T value = std::move(stream->items.front());
+                stream->items.pop_front();
+                return value;
+            }
+        };
+        return Awaiter{this};
+    }
+
+private:
+    void wake() {
+        if (waiter) {
+            scheduler.post(std::exchange(waiter, nullptr));
+        }
+    }
+
+    Scheduler& scheduler;
+    std::deque<T> items;
+    std::coroutine_handle<> waiter;
+    bool closed = false;
+};
+
+struct IncomingMessage {
+    std::string fromClientId;
+    std::string message;
+};
+
+// Coroutine-friendly chat client; all methods must be called on the scheduler's thread
+class Client : private IChatClientObserver {
+public:
+    explicit Client(Scheduler& s)
+        : scheduler(s), client(createPollingChatClient()), messages(s), presence(s) {
+        client->registerObserver(this);
+        scheduler.clients.push_back(this);
+    }
+
+    ~Client() {
+        client->unregisterObserver(this);
+        client->disconnect();
+        delete client;
+        for (auto it = scheduler.clients.begin(); it != scheduler.clients.end(); ++it) {
+            if (*it == this) {
+                scheduler.clients.erase(it);
+                break;
+            }
+        }
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    // co_await: true once the server has registered us
+    auto connect(const std::string& clientId, const std::string& serverIP, int serverPort) {
+        struct Awaiter {
+            Client* self;
+            std::string clientId;
+            std::string serverIP;
+            int serverPort;
+            bool ok = false;
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> h) {
+                if (!self->client->connect(clientId, serverIP, serverPort)) {
+                    return false;
+                }
+                self->messages.reopen();
+                self->presence.reopen();
+                self->connectWaiter = h;
+                self->connectResult = &ok;
+                return true;
+            }
+            bool await_resume() const noexcept { return ok; }
+        };
+        return Awaiter{this, clientId, serverIP, serverPort};
+    }
+
+    // co_await: the delivery status ("OK"), or an error once the message
+    // cannot be delivered ("NOT_SENT", "NOT_ACTIVE", "DISCONNECTED") or its
+    // fate is unknown because the session could not be resumed ("SESSION_LOST")
+    auto send(const std::string& toClientId, const std::string& message) {
+        struct Awaiter {
+            Client* self;
+            std::string toClientId;
+            std::string message;
+            std::string result;
+
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> h) {
+                unsigned long seq = self->client->postMessage(toClientId, message);
+                if (seq == 0) {
+                    result = "NOT_SENT";
+                    return false;
+                }
+                self->pendingSends[toClientId].push_back(PendingSend{seq, h, &result});
+                return true;
+            }
+            std::string await_resume() { return std::move(result); }
+        };
+        return Awaiter{this, toClientId, message, std::string()};
+    }
+
+    // co_await: next incoming message, std::nullopt after a disconnect
+    auto nextMessage() {
+        return messages.next();
+    }
+
+    // co_await: next client whose status changed, std::nullopt after a disconnect
+    auto nextPresenceChange() {
+        return presence.next();
+    }
+
+    void disconnect() {
+        client->disconnect();
+    }
+
+    IPollingChatClient& raw() {
+        return *client;
+    }
+
+private:
+    friend class Scheduler;
+
+    struct PendingSend {
+        unsigned long seq;
+        std::coroutine_handle<> handle;
+        std::string* result;
+    };
+
+    void completeConnect(bool ok) {
+        if (connectWaiter) {
+            *connectResult = ok;
+            scheduler.post(std::exchange(connectWaiter, nullptr));
+        }
+    }
+
+    void completeSend(const PendingSend& send, const std::string& result) {
+        *send.result = result;
+        scheduler.post(send.handle);
+    }
+
+    void failAllSends(const std::string& result) {
+        for (auto& pair : pendingSends) {
+            for (const auto& send : pair.second) {
+                completeSend(send, result);
+            }
+        }
+        pendingSends.clear();
+    }
+
+    // IChatClientObserver, called from processIO() on the scheduler's thread
+    void onMessageReceived(const std::string& fromClientId, const std::string& message) override {
+        messages.push(IncomingMessage{fromClientId, message});
+    }
+
+    void onResultReceived(const std::string&, const std::string&) override {}
+
+    void onResultsReceived(const std::string& fromClientId, unsigned long firstSeq,
+                           unsigned long lastSeq, const std::string& result) override {
+        auto it = pendingSends.find(fromClientId);
+        if (it == pendingSends.end()) return;
+
+        std::deque<PendingSend>& sends = it->second;
+        for (auto send = sends.begin(); send != sends.end() && send->seq <= lastSeq;) {
+            if (send->seq >= firstSeq) {
+                completeSend(*send, result);
+                send = sends.erase(send);
+            } else {
+                ++send; // older than this receipt, waits for its own receipt or error
+            }
+        }
+    }
+
+    void onConnected() override {
+        completeConnect(true);
+    }
+
+    void onDisconnected() override {
+        completeConnect(false);
+        failAllSends("DISCONNECTED");
+        messages.close();
+        presence.close();
+    }
+
+    void onClientListUpdated(const std::vector<ClientInfo>&) override {
+        // The server broadcasts the list once it has registered us
+        completeConnect(true);
+
+        std::shared_ptr<const ClientListSnapshot> snapshot = client->getClientListSnapshot();
+        for (const auto& info : client->getClientListChangesSince(presenceVersion)) {
+            presence.push(info);
+        }
+        presenceVersion = snapshot->version;
+    }
+
+    void onReconnected(bool resumed) override {
+        // A new session: receipts for messages sent in the old one may never
+        // come, so even those the library sends again fail here
+        if (!resumed) {
+            failAllSends("SESSION_LOST");
+        }
+    }
+
+    void onMessageFailed(const std::string& toClientId, unsigned long seq, const std::string&) override {
+        auto it = pendingSends.find(toClientId);
+        if (it == pendingSends.end()) return;
+
+        for (auto send = it->second.begin(); send != it->second.end(); ++send) {
+            if (send->seq == seq) {
+                completeSend(*send, "NOT_ACTIVE");
+                it->second.erase(send);
+                break;
+            }
+        }
+    }
+
+    void onError(const std::string&) override {}
+
+    Scheduler& scheduler;
+    IPollingChatClient* client;
+    AsyncStream<IncomingMessage> messages;
+    AsyncStream<ClientInfo> presence;
+    unsigned long presenceVersion = 0;
+
+    std::coroutine_handle<> connectWaiter;
+    bool* connectResult = nullptr;
+    std::map<std::string, std::deque<PendingSend>> pendingSends; // Key: peer, in sequence order
+};
+
+inline void Scheduler::run() {
+    stopped = false;
+    std::vector<pollfd> fds;
+    std::vector<Client*> owners;
+
+    while (!stopped && liveTasks > 0) {
+        // Resume everything that is ready, including coroutines made ready meanwhile
+        while (!ready.empty()) {
+            std::coroutine_handle<> h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+        if (stopped || liveTasks == 0) {
+            break;
+        }
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.top().deadline <= now) {
+            ready.push_back(timers.top().handle);
+            timers.pop();
+        }
+        if (!ready.empty()) {
+            continue;
+        }
+
+        // Wait for sockets, client timers or the next sleep() deadline
+        int timeoutMs = -1;
+        if (!timers.empty()) {
+            timeoutMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                timers.top().deadline - now).count()) + 1;
+        }
+        fds.clear();
+        owners.clear();
+        for (Client* c : clients) {
+            IPollingChatClient& raw = c->raw();
+            int clientTimeout = raw.getTimeoutMs();
+            if (clientTimeout >= 0 && (timeoutMs < 0 || clientTimeout < timeoutMs)) {
+                timeoutMs = clientTimeout;
+            }
+            if (raw.getFd() >= 0) {
+                fds.push_back(pollfd{raw.getFd(), raw.getWantedEvents(), 0});
+                owners.push_back(c);
+            }
+        }
+        if (fds.empty() && timeoutMs < 0) {
+            break; // every task waits for something that can no longer happen
+        }
+
+        poll(fds.empty() ? nullptr : &fds[0], fds.size(), timeoutMs);
+
+        for (size_t i = 0; i < fds.size(); ++i) {
+            if (fds[i].revents) {
+                owners[i]->raw().processIO();
+            }
+        }
+        for (Client* c : clients) {
+            if (c->raw().getTimeoutMs() == 0) {
+                c->raw().onTimer();
+            }
+        }
+    }
+}
+
+}
+}
+
+#endif // CHAT_CLIENT_CORO_H
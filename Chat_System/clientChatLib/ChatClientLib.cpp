@@ -1,9 +1,21 @@
 #include "ChatClientLib.h"
+#include "ChatTrace.h"
+#include "ChatProtocol.h"
+#include "OutboundLanes.h"
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <deque>
+#include <chrono>
 #include <algorithm>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -11,7 +23,41 @@
 
 namespace CHAT_SYSTEM {
 
-class ChatClient : public IChatClient {
+// Receipts are flushed after this many messages from one peer...
+static const unsigned long RECEIPT_BATCH_MAX = 16;
+// ...or this long after the first unacknowledged message
+static const int RECEIPT_DELAY_MS = 20;
+
+// Largest write assembled from queued frames, so that a frame queued later on
+// a higher lane never waits behind much bulk data
+static const size_t WRITE_BATCH_BYTES = 16 * 1024;
+
+// Reconnect delay after a lost connection: doubles from the first delay up to
+// the maximum, until every attempt is used up
+static const int RECONNECT_FIRST_DELAY_MS = 100;
+static const int RECONNECT_MAX_DELAY_MS = 5000;
+static const int RECONNECT_MAX_ATTEMPTS = 10;
+
+// Locks the mutex only when enabled; threadless clients run without locks
+class OptionalLock {
+public:
+    OptionalLock(std::mutex& m, bool enabled) : mutex(enabled ? &m : nullptr) {
+        if (mutex) {
+            mutex->lock();
+        }
+    }
+    
+    ~OptionalLock() {
+        if (mutex) {
+            mutex->unlock();
+        }
+    }
+    
+private:
+    std::mutex* mutex;
+};
+
+class ChatClient : public IPollingChatClient {
 private:
     int clientSocket;
     std::string clientId;
@@ -19,16 +65,88 @@ private:
     int serverPort;
     bool connected;
     
+    // Threadless mode: non-blocking socket driven through processIO()/onTimer()
+    bool threadless;
+    bool connecting;
+    
+    // Frames waiting to be written, per priority lane (guarded by socketMutex)
+    OutboundLanes lanes;
+    LaneStats laneStats[LANE_COUNT];
+    // Threaded: a caller is currently writing (guarded by socketMutex)
+    bool writing;
+    // Threadless: bytes taken from the lanes but not yet accepted by the socket
+    std::string outbound;
+    
+    // Received bytes not yet split into frames
+    std::string inbound;
+    
+    // Session resumption (guarded by socketMutex, framesReceived and
+    // framesAcked are only used by the receiving thread): the token from
+    // SESSION, the session frames (isSessionFrame) read and written, numbered
+    // across the session, and those written that the server has not
+    // acknowledged yet
+    std::string sessionToken;
+    unsigned long long framesReceived;
+    unsigned long long framesAcked;
+    unsigned long long framesSent;
+    std::deque<std::string> sentLog;
+    size_t sentLogBytes;
+    // Frames to write before the lanes: those to send again after a resume
+    std::deque<std::string> resend;
+    // RESUME written on a new connection, not answered yet: nothing else is
+    // written until the server says how many frames it read
+    bool resuming;
+    std::string resumeFrame;
+    // Between a lost connection and the next attempt: frames are only queued
+    bool reconnecting;
+    int reconnectAttempts;
+    std::chrono::steady_clock::time_point reconnectAt; // threadless
+    std::condition_variable writeDone;      // threaded: writing became false
+    std::condition_variable reconnectWake;  // threaded: disconnect() during a backoff
+    
     std::vector<IChatClientObserver*> observers;
     std::mutex observersMutex;
     std::mutex socketMutex;
 
     std::thread* receiveThread;
     bool shouldRun;
+
+    // Latest client list, replaced atomically under clientListMutex
+    std::shared_ptr<const ClientListSnapshot> clientList;
+    std::mutex clientListMutex;
+    
+    // Once the session subscribes to presence the server reports only the
+    // watched clients, so the snapshot keeps only those (guarded by clientListMutex)
+    bool presenceSubscribed;
+    std::set<std::string> presenceWatched;
+    
+    // Last sequence number sent to each peer (guarded by socketMutex)
+    std::map<std::string, unsigned long> sentSeq;
+    
+    // Contiguous run of received messages not yet acknowledged to a peer
+    struct PendingReceipt {
+        unsigned long firstSeq;
+        unsigned long lastSeq;
+        std::chrono::steady_clock::time_point deadline;
+        // Sampled message in this run (at most one) and when it was received
+        unsigned long long traceId;
+        long long tracedAtUs;
+    };
+    // Key: peer clientId (used by the receive thread only)
+    std::map<std::string, PendingReceipt> pendingReceipts;
+    
+    // Send time of sampled messages waiting for their receipt. Key: trace id
+    std::map<unsigned long long, long long> tracedSends;
+    std::mutex tracedSendsMutex;
 public:
-    ChatClient() 
+    ChatClient(bool pollDriven) 
         : clientSocket(-1), serverPort(0), connected(false), 
-          receiveThread(nullptr), shouldRun(false) {
+          threadless(pollDriven), connecting(false), writing(false),
+          framesReceived(0), framesAcked(0), framesSent(0), sentLogBytes(0),
+          resuming(false), reconnecting(false), reconnectAttempts(0),
+          receiveThread(nullptr), shouldRun(false),
+          clientList(std::make_shared<ClientListSnapshot>()), presenceSubscribed(false) {
+        Tracer::instance().init("libchatclient");
     }
     
     ~ChatClient() {
@@ -37,12 +155,12 @@ public:
     
     // Observer management
     void registerObserver(IChatClientObserver* observer) override {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         observers.push_back(observer);
     }
     
     void unregisterObserver(IChatClientObserver* observer) override {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         observers.erase(remove(observers.begin(), observers.end(), observer),observers.end());
     }
     
@@ -53,49 +171,44 @@ public:
             return false;
         }
         
+        if (!isValidClientId(id)) {
+            notifyError("Invalid client id");
+            return false;
+        }
+        
         clientId = id;
         serverIP = ip;
         serverPort = port;
         
-        // Create socket
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+        std::string error;
+        clientSocket = openSocket(error);
         if (clientSocket < 0) {
-            notifyError("Failed to create socket");
-            return false;
-        }
-        
-        // Setup server address
-        sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(serverPort);
-        
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            notifyError("Invalid server address");
-            close(clientSocket);
-            clientSocket = -1;
-            return false;
-        }
-        
-        // Connect to server
-        if (::connect(clientSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
-            notifyError("Connection to server failed");
-            close(clientSocket);
-            clientSocket = -1;
+            notifyError(error);
             return false;
         }
         
+        sessionToken.clear();
+        pendingReceipts.clear();
+        resetPresence();
+        framesReceived = 0;
+        framesAcked = 0;
+        framesSent = 0;
+        resuming = false;
+        reconnecting = false;
+        reconnectAttempts = 0;
         connected = true;
         
-        // Send registration message
-        std::string registerMsg = "REGISTER|" + clientId;
-        if (!sendToServer(registerMsg)) {
+        // Send registration message (queued until the connect completes)
+        if (!sendToServer(encode<Wire::Register>(clientId), LANE_CONTROL)) {
             disconnect();
             return false;
         }
         
         // Start receive thread
-        shouldRun = true;
-        receiveThread = new std::thread(&ChatClient::receiveLoop, this);
+        if (!threadless) {
+            shouldRun = true;
+            receiveThread = new std::thread(&ChatClient::receiveLoop, this);
+        }
         
         return true;
     }
@@ -105,13 +218,17 @@ public:
             return;
         }
         
-        // Send disconnect message
-        std::string disconnectMsg = "DISCONNECT|" + clientId;
-        sendToServer(disconnectMsg);
-        
-        // Stop receive thread
-        shouldRun = false;
-        connected = false;
+        // Stop receive thread first, so that the receipts it keeps can be
+        // sent: the server does not close the connection, so wake it from
+        // recv() (the socket stays writable) or from a reconnect backoff
+        {
+            OptionalLock lock(socketMutex, !threadless);
+            shouldRun = false;
+            if (clientSocket != -1 && receiveThread) {
+                shutdown(clientSocket, SHUT_RD);
+            }
+        }
+        reconnectWake.notify_all();
         
         if (receiveThread) {
             if (receiveThread->joinable()) {
@@ -121,11 +238,35 @@ public:
             receiveThread = nullptr;
         }
         
+        // Acknowledge what was received, then send disconnect message
+        if (clientSocket != -1 && !connecting && !reconnecting && !resuming) {
+            flushReceipts(true);
+            sendToServer(encode<Wire::Disconnect>(clientId), LANE_CONTROL);
+        }
+        
+        {
+            OptionalLock lock(socketMutex, !threadless);
+            connected = false;
+            connecting = false;
+            if (clientSocket != -1) {
+                shutdown(clientSocket, SHUT_RDWR);
+            }
+        }
+        
         // Close socket
         if (clientSocket != -1) {
             close(clientSocket);
             clientSocket = -1;
         }
+        lanes.clear();
+        outbound.clear();
+        inbound.clear();
+        resend.clear();
+        sentLog.clear();
+        sentLogBytes = 0;
+        sessionToken.clear();
+        resuming = false;
+        reconnecting = false;
         
         notifyDisconnected();
     }
@@ -137,8 +278,50 @@ public:
             return false;
         }
         
-        std::string msg = "SEND_MSG|" + clientId + "|" + toClientId + "|" + message;
-        return sendToServer(msg);
+        return postMessage(toClientId, message) != 0;
+    }
+    
+    unsigned long postMessage(const std::string& toClientId, const std::string& message) override {
+        if (!connected) {
+            notifyError("Not connected to server");
+            return 0;
+        }
+        
+        if (!isValidClientId(toClientId) || !isValidField(message)) {
+            notifyError("Invalid recipient or message");
+            return 0;
+        }
+        
+        Tracer& tracer = Tracer::instance();
+        unsigned long long traceId = tracer.sample();
+        long long startUs = traceId ? Tracer::nowUs() : 0;
+        
+        // The sequence number is assigned under the socket lock so that it
+        // matches the order of the messages on the wire (the bulk lane is FIFO)
+        unsigned long seq;
+        {
+            OptionalLock lock(socketMutex, !threadless);
+            seq = sentSeq[toClientId] + 1;
+            std::string seqField = std::to_string(seq);
+            if (traceId) {
+                seqField += ":" + Tracer::format(traceId);
+            }
+            std::string msg = encode<Wire::SendMsg>(clientId, toClientId, seqField, message);
+            if (!queueFrame(msg, LANE_BULK)) {
+                return 0;
+            }
+            sentSeq[toClientId] = seq;
+        }
+        if (!flushOutbound()) {
+            return 0;
+        }
+        
+        if (traceId) {
+            tracer.span("client.send", traceId, startUs, Tracer::nowUs());
+            OptionalLock traceLock(tracedSendsMutex, !threadless);
+            tracedSends[traceId] = startUs;
+        }
+        return seq;
     }
     
     bool sendResult(const std::string& toClientId, const std::string& result) override {
@@ -147,8 +330,42 @@ public:
             return false;
         }
         
-        std::string msg = "RESULT|" + clientId + "|" + toClientId + "|" + result;
-        return sendToServer(msg);
+        if (!isValidClientId(toClientId) || !isValidField(result)) {
+            notifyError("Invalid recipient or result");
+            return false;
+        }
+        
+        return sendToServer(encode<Wire::Result>(clientId, toClientId, result), LANE_RECEIPT);
+    }
+    
+    bool requestClientList(const std::string& prefix, size_t offset, size_t limit) override {
+        if (!connected) {
+            notifyError("Not connected to server");
+            return false;
+        }
+        
+        if (!isValidField(prefix)) {
+            notifyError("Invalid client id prefix");
+            return false;
+        }
+        
+        return sendToServer(encode<Wire::GetListId>(offset, limit, prefix), LANE_CONTROL);
+    }
+    
+    bool subscribePresence(const std::vector<std::string>& clientIds) override {
+        if (!sendSubscription<Wire::Subscribe>(clientIds)) {
+            return false;
+        }
+        watchPresence(clientIds, true);
+        return true;
+    }
+    
+    bool unsubscribePresence(const std::vector<std::string>& clientIds) override {
+        if (!sendSubscription<Wire::Unsubscribe>(clientIds)) {
+            return false;
+        }
+        watchPresence(clientIds, false);
+        return true;
     }
     
     // Status
@@ -160,27 +377,515 @@ public:
         return clientId;
     }
 
+    // Event loop integration (threadless mode)
+    int getFd() const override {
+        return clientSocket;
+    }
+    
+    short getWantedEvents() const override {
+        if (clientSocket < 0) {
+            return 0;
+        }
+        return POLLIN | ((connecting || !outbound.empty() || !resend.empty() || !lanes.empty()) ? POLLOUT : 0);
+    }
+    
+    void processIO() override {
+        if (clientSocket < 0) {
+            return;
+        }
+        
+        if (connecting) {
+            // The non-blocking connect has finished once the socket is
+            // writable; SO_ERROR then tells whether it succeeded
+            pollfd pfd;
+            pfd.fd = clientSocket;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) == 0) {
+                return;
+            }
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(clientSocket, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                if (sessionToken.empty()) {
+                    notifyError("Connection to server failed");
+                }
+                connectionLost();
+                return;
+            }
+            connecting = false;
+        }
+        
+        if (!flushOutbound()) {
+            connectionLost();
+            return;
+        }
+        
+        char buffer[4096];
+        while (true) {
+            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
+            if (bytesRead > 0) {
+                handleIncoming(buffer, bytesRead);
+                if (clientSocket < 0) {
+                    return; // disconnected from an observer callback
+                }
+                continue;
+            }
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            connectionLost();
+            return;
+        }
+        
+        flushReceipts(false);
+    }
+    
+    int getTimeoutMs() const override {
+        if (reconnecting) {
+            long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                reconnectAt - std::chrono::steady_clock::now()).count();
+            return ms < 0 ? 0 : static_cast<int>(ms) + 1;
+        }
+        return receiptTimeoutMs();
+    }
+    
+    void onTimer() override {
+        if (reconnecting) {
+            if (std::chrono::steady_clock::now() >= reconnectAt) {
+                reconnectNow();
+            }
+            return;
+        }
+        if (clientSocket < 0 || connecting) {
+            return;
+        }
+        flushReceipts(false);
+    }
+
+    // Client list
+    std::shared_ptr<const ClientListSnapshot> getClientListSnapshot() const override {
+        return std::atomic_load(&clientList);
+    }
+
+    std::vector<IChatClientObserver::ClientInfo> getListClientId() const override {
+        return getClientListSnapshot()->clients;
+    }
+
+    bool isClientActive(const std::string& id) const override {
+        std::shared_ptr<const ClientListSnapshot> snapshot = getClientListSnapshot();
+        const IChatClientObserver::ClientInfo* client = snapshot->find(id);
+        return client != nullptr && client->isActive;
+    }
+
+    std::vector<IChatClientObserver::ClientInfo> getClientListChangesSince(unsigned long version) const override {
+        std::shared_ptr<const ClientListSnapshot> snapshot = getClientListSnapshot();
+        std::vector<IChatClientObserver::ClientInfo> changes;
+        for (size_t i = 0; i < snapshot->clients.size(); ++i) {
+            if (snapshot->changedVersion[i] > version) {
+                changes.push_back(snapshot->clients[i]);
+            }
+        }
+        return changes;
+    }
+    
+    std::vector<OutboundLaneStats> getOutboundStats() const override {
+        std::vector<OutboundLaneStats> stats;
+        for (int i = 0; i < LANE_COUNT; ++i) {
+            OutboundLaneStats lane;
+            lane.lane = LANE_NAMES[i];
+            lane.frames = laneStats[i].frames.load();
+            lane.avgWaitUs = lane.frames ? laneStats[i].totalWaitUs.load() / lane.frames : 0;
+            lane.maxWaitUs = laneStats[i].maxWaitUs.load();
+            stats.push_back(lane);
+        }
+        return stats;
+    }
+
 private:
-    bool sendToServer(const std::string& message) {
-        std::lock_guard<std::mutex> lock(socketMutex);
+    // New socket connected (or, threadless, connecting) to the server, -1 on failure
+    int openSocket(std::string& error) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            error = "Failed to create socket";
+            return -1;
+        }
         
-        if (clientSocket < 0 || !connected) {
+        // Setup server address
+        sockaddr_in serverAddr;
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_port = htons(serverPort);
+        
+        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
+            error = "Invalid server address";
+            close(fd);
+            return -1;
+        }
+        
+        // Threadless clients finish connecting in processIO()
+        if (threadless) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+        
+        // Connect to server
+        if (::connect(fd, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+            if (!threadless || errno != EINPROGRESS) {
+                error = "Connection to server failed";
+                close(fd);
+                return -1;
+            }
+            connecting = true;
+        }
+        return fd;
+    }
+    
+    template <typename Subscription>
+    bool sendSubscription(const std::vector<std::string>& clientIds) {
+        if (!connected) {
+            notifyError("Not connected to server");
+            return false;
+        }
+        
+        // SUBSCRIBE|clientId|... (an empty list subscribes to nobody yet)
+        std::string msg = encode<Subscription>();
+        for (const auto& id : clientIds) {
+            if (!isValidClientId(id)) {
+                notifyError("Invalid client id");
+                return false;
+            }
+            appendField(msg, id);
+        }
+        return sendToServer(msg, LANE_CONTROL);
+    }
+    
+    bool sendToServer(const std::string& message, Lane lane) {
+        {
+            OptionalLock lock(socketMutex, !threadless);
+            if (!queueFrame(message, lane)) {
+                return false;
+            }
+        }
+        return flushOutbound();
+    }
+    
+    // Called with socketMutex held; frames queued while reconnecting wait for the resume
+    bool queueFrame(const std::string& message, Lane lane) {
+        if (!connected) {
             return false;
         }
         
-        ssize_t sent = send(clientSocket, message.c_str(), message.length(), 0);
-        return sent > 0;
+        lanes.push(message + FRAME_END, lane);
+        return true;
+    }
+    
+    // Take queued frames in lane order, up to WRITE_BATCH_BYTES (socketMutex held).
+    // After a reconnect RESUME goes alone, then the frames sent again.
+    bool nextBatch(std::string& batch) {
+        if (resuming) {
+            batch += resumeFrame;
+            resumeFrame.clear();
+            return !batch.empty();
+        }
+        
+        while (batch.length() < WRITE_BATCH_BYTES && !resend.empty()) {
+            batch += resend.front();
+            logSent(resend.front());
+            resend.pop_front();
+        }
+        
+        std::string frame;
+        Lane lane;
+        long long waitUs;
+        while (batch.length() < WRITE_BATCH_BYTES && lanes.pop(frame, lane, waitUs)) {
+            laneStats[lane].record(waitUs);
+            batch += frame;
+            logSent(frame);
+        }
+        return !batch.empty();
+    }
+    
+    // Counted as written even if the send fails: the server acknowledges
+    // the frames it actually read (socketMutex held)
+    void logSent(const std::string& frame) {
+        if (!isSessionFrame(frame)) {
+            return;
+        }
+        ++framesSent;
+        sentLogBytes += frame.length();
+        sentLog.push_back(frame);
+        while (sentLogBytes > RESUME_LOG_BYTES) {
+            sentLogBytes -= sentLog.front().length();
+            sentLog.pop_front();
+        }
+    }
+    
+    // SESSION_ACK|framesRead from the server
+    void acknowledgeFrames(unsigned long long framesRead) {
+        OptionalLock lock(socketMutex, !threadless);
+        while (!sentLog.empty() && framesSent - sentLog.size() < framesRead) {
+            sentLogBytes -= sentLog.front().length();
+            sentLog.pop_front();
+        }
+    }
+    
+    // Write queued frames, false on a socket error.
+    // Threaded: the first caller to find no write in progress becomes the
+    // writer and also sends whatever other threads queue meanwhile.
+    // Threadless: writes what the socket accepts without blocking.
+    // While reconnecting frames stay queued.
+    bool flushOutbound() {
+        if (threadless) {
+            if (connecting || reconnecting) {
+                return true;
+            }
+            while (!outbound.empty() || nextBatch(outbound)) {
+                ssize_t sent = send(clientSocket, outbound.data(), outbound.size(), MSG_NOSIGNAL);
+                if (sent > 0) {
+                    outbound.erase(0, sent);
+                } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return true;
+                } else if (sent < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    return false;
+                }
+            }
+            return true;
+        }
+        
+        std::string batch;
+        {
+            std::lock_guard<std::mutex> lock(socketMutex);
+            if (writing || reconnecting) {
+                return true;
+            }
+            writing = true;
+        }
+        
+        bool ok = true;
+        int fd;
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(socketMutex);
+                batch.clear();
+                if (!ok || reconnecting || !nextBatch(batch)) {
+                    writing = false;
+                    writeDone.notify_all();
+                    // Frames already logged are sent again after a reconnect
+                    return ok || !sessionToken.empty();
+                }
+                fd = clientSocket;
+            }
+            
+            size_t total = 0;
+            while (ok && total < batch.length()) {
+                ssize_t sent = send(fd, batch.c_str() + total, batch.length() - total, MSG_NOSIGNAL);
+                ok = (sent > 0);
+                total += ok ? sent : 0;
+            }
+        }
+    }
+    
+    // Queue RESUME on the connection just opened. Until the server answers,
+    // what the session read and wrote stays as it was (socketMutex held).
+    void prepareResume() {
+        outbound.clear();
+        inbound.clear();
+        
+        // Frames queued for the lost connection follow the logged ones, but
+        // acknowledgements of what it read mean nothing on the next one
+        std::string frame;
+        Lane lane;
+        long long waitUs;
+        while (lanes.pop(frame, lane, waitUs)) {
+            if (isSessionFrame(frame)) {
+                resend.push_back(frame);
+            }
+        }
+        
+        resumeFrame = encode<Wire::Resume>(clientId, sessionToken, framesReceived) + FRAME_END;
+        resuming = true;
+    }
+    
+    // RESUMED: the server read framesRead frames of the session. Write the
+    // rest of the log again under the same numbers. Returns how many frames
+    // were lost, dropped from a full log before the server read them
+    // (socketMutex held).
+    unsigned long long resumeSession(unsigned long long framesRead) {
+        unsigned long long firstLogged = framesSent - sentLog.size() + 1;
+        while (!sentLog.empty() && firstLogged <= framesRead) {
+            sentLogBytes -= sentLog.front().length();
+            sentLog.pop_front();
+            ++firstLogged;
+        }
+        unsigned long long lost = (firstLogged > framesRead + 1) ? firstLogged - 1 - framesRead : 0;
+        resend.insert(resend.begin(), sentLog.begin(), sentLog.end());
+        framesSent = std::min(framesSent, framesRead);
+        sentLog.clear();
+        sentLogBytes = 0;
+        // RESUME acknowledged what was read
+        framesAcked = framesReceived;
+        resuming = false;
+        return lost;
+    }
+    
+    // RESUME_FAILED: register again on this connection, followed by the
+    // frames never written. Returns the messages written on the lost
+    // connection and never acknowledged: whether they arrived is unknown
+    // (socketMutex held).
+    std::vector<std::pair<std::string, unsigned long>> restartSession() {
+        std::vector<std::pair<std::string, unsigned long>> lost;
+        for (const std::string& logged : sentLog) {
+            // Logged frames end with FRAME_END
+            Frame frame;
+            if (decodeFrame(StringView(logged.data(), logged.length() - 1), frame) && frame.opcode == OP_SEND_MSG) {
+                Wire::SendMsg message = frame.as<Wire::SendMsg>();
+                lost.push_back(std::make_pair(message.toId.str(), static_cast<unsigned long>(message.seq.toNumber())));
+            }
+        }
+        
+        sessionToken.clear();
+        sentLog.clear();
+        sentLogBytes = 0;
+        framesSent = 0;
+        framesReceived = 0;
+        framesAcked = 0;
+        resetPresence();
+        resend.push_front(encode<Wire::Register>(clientId) + FRAME_END);
+        resuming = false;
+        return lost;
+    }
+    
+    // Delay before the next reconnect attempt, -1 once they are used up
+    int nextReconnectDelayMs() {
+        if (sessionToken.empty() || reconnectAttempts >= RECONNECT_MAX_ATTEMPTS) {
+            return -1;
+        }
+        return std::min(RECONNECT_FIRST_DELAY_MS << reconnectAttempts++, RECONNECT_MAX_DELAY_MS);
+    }
+    
+    // Threaded: the connection dropped. Reconnect with exponential backoff and
+    // resume the session; false without a session or once every attempt failed.
+    bool reconnect() {
+        {
+            std::unique_lock<std::mutex> lock(socketMutex);
+            if (sessionToken.empty()) {
+                return false;
+            }
+            reconnecting = true;
+            // A writer still busy with the old socket fails and steps aside
+            shutdown(clientSocket, SHUT_RDWR);
+            writeDone.wait(lock, [this]() { return !writing; });
+            close(clientSocket);
+            clientSocket = -1;
+        }
+        
+        int delayMs;
+        while ((delayMs = nextReconnectDelayMs()) >= 0) {
+            {
+                std::unique_lock<std::mutex> lock(socketMutex);
+                if (reconnectWake.wait_for(lock, std::chrono::milliseconds(delayMs), [this]() { return !shouldRun; })) {
+                    break;
+                }
+            }
+            
+            std::string error;
+            int fd = openSocket(error);
+            if (fd < 0) {
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(socketMutex);
+                if (!shouldRun) {
+                    close(fd);
+                    break;
+                }
+                clientSocket = fd;
+                prepareResume();
+                reconnecting = false;
+            }
+            flushOutbound();
+            return true;
+        }
+        
+        std::lock_guard<std::mutex> lock(socketMutex);
+        reconnecting = false;
+        return false;
+    }
+    
+    // Threadless: the backoff delay is over, start connecting again
+    void reconnectNow() {
+        std::string error;
+        int fd = openSocket(error);
+        if (fd < 0) {
+            connectionLost();
+            return;
+        }
+        
+        clientSocket = fd;
+        prepareResume();
+        reconnecting = false;
+        if (!flushOutbound()) {
+            connectionLost();
+        }
+    }
+    
+    // Threadless: the server closed the connection or the socket failed.
+    // With a session to resume onTimer() reconnects after a backoff delay.
+    void connectionLost() {
+        if (clientSocket != -1) {
+            close(clientSocket);
+            clientSocket = -1;
+        }
+        connecting = false;
+        outbound.clear();
+        inbound.clear();
+        
+        int delayMs = nextReconnectDelayMs();
+        if (delayMs >= 0) {
+            reconnecting = true;
+            reconnectAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+            // Queued now, sent after the RESUME
+            flushReceipts(true);
+            return;
+        }
+        
+        connected = false;
+        resuming = false;
+        reconnecting = false;
+        lanes.clear();
+        resend.clear();
+        sentLog.clear();
+        sentLogBytes = 0;
+        sessionToken.clear();
+        pendingReceipts.clear();
+        notifyDisconnected();
     }
     
     void receiveLoop() {
         char buffer[4096];
         
         while (shouldRun && connected) {
-            memset(buffer, 0, sizeof(buffer));
+            // Wake up in time to flush the oldest pending receipt
+            pollfd pfd;
+            pfd.fd = clientSocket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, receiptTimeoutMs()) == 0) {
+                flushReceipts(false);
+                continue;
+            }
             
-            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
             
             if (bytesRead <= 0) {
+                if (shouldRun && reconnect()) {
+                    continue;
+                }
                 if (shouldRun) {
                     connected = false;
                     notifyDisconnected();
@@ -188,122 +893,465 @@ private:
                 break;
             }
             
-            std::string message(buffer);
-            processServerMessage(message);
+            handleIncoming(buffer, bytesRead);
+            flushReceipts(false);
         }
     }
     
-    void processServerMessage(const std::string& msg) {
-        size_t pos = msg.find('|');
-        if (pos == std::string::npos) return;
+    // Split the stream into frames
+    void handleIncoming(const char* data, size_t length) {
+        // The bytes kept from the last read hold no FRAME_END
+        size_t scanFrom = inbound.length();
+        inbound.append(data, length);
+        size_t start = 0;
+        size_t end;
+        while ((end = inbound.find(FRAME_END, std::max(start, scanFrom))) != std::string::npos) {
+            StringView frame(inbound.data() + start, end - start);
+            if (isSessionFrame(frame)) {
+                ++framesReceived;
+            }
+            processServerMessage(frame);
+            if (clientSocket < 0) {
+                return; // disconnected from an observer callback
+            }
+            start = end + 1;
+        }
+        inbound.erase(0, start);
         
-        std::string command = msg.substr(0, pos);
-        std::string data = msg.substr(pos + 1);
+        // Drop the connection; the next read reports it as lost
+        if (inbound.length() > FRAME_MAX_BYTES) {
+            notifyError("Frame from server exceeds " + std::to_string(FRAME_MAX_BYTES) + " bytes");
+            inbound.clear();
+            shutdown(clientSocket, SHUT_RDWR);
+            return;
+        }
         
+        // Let the server drop what it keeps for resending
+        if (!sessionToken.empty() && framesReceived - framesAcked >= SESSION_ACK_FRAMES) {
+            framesAcked = framesReceived;
+            sendToServer(encode<Wire::SessionAck>(framesAcked), LANE_CONTROL);
+        }
+    }
+    
+    // The fields are views into inbound: copy what an observer callback
+    // might outlive (a callback may disconnect and clear the buffer)
+    void processServerMessage(StringView msg) {
+        Frame frame;
+        if (!decodeFrame(msg, frame)) return;
         
-        if (command == "REGISTERD") { 
+        switch (frame.opcode) {
+        case OP_REGISTERED:
             notifyConnected();
+            break;
+        case OP_SESSION: {
+            OptionalLock lock(socketMutex, !threadless);
+            sessionToken = frame.as<Wire::Session>().resumeToken.str();
+            reconnectAttempts = 0;
+            break;
+        }
+        case OP_SESSION_ACK:
+            acknowledgeFrames(frame.as<Wire::SessionAck>().framesRead.toNumber());
+            break;
+        case OP_RESUMED: {
+            // The missed frames follow
+            unsigned long long lost;
+            {
+                OptionalLock lock(socketMutex, !threadless);
+                lost = resumeSession(frame.as<Wire::Resumed>().framesRead.toNumber());
+            }
+            reconnectAttempts = 0;
+            if (lost > 0) {
+                notifyError("Session resumed without " + std::to_string(lost) + " frames");
+            }
+            notifyReconnected(true);
+            flushOutbound();
+            break;
+        }
+        case OP_RESUME_FAILED: {
+            // Start a new session
+            std::string reason = frame.as<Wire::ResumeFailed>().reason.str();
+            std::vector<std::pair<std::string, unsigned long>> lost;
+            {
+                OptionalLock lock(socketMutex, !threadless);
+                lost = restartSession();
+            }
+            notifyError("Session could not be resumed: " + reason);
+            notifyReconnected(false);
+            for (const auto& message : lost) {
+                notifyMessageFailed(message.first, message.second, "Session lost before delivery was confirmed");
+            }
+            flushOutbound();
+            break;
         }
-        else if (command == "MESSAGE") {
-            // MESSAGE|fromId|messageText
-            size_t pos2 = data.find('|');
-            if (pos2 != std::string::npos) {
-                std::string fromId = data.substr(0, pos2);
-                std::string messageText = data.substr(pos2 + 1);
-                
-                notifyMessageReceived(fromId, messageText);
-                
-                // Auto send OK result
-                sendResult(fromId, "OK");
+        case OP_MESSAGE: {
+            Wire::Message message = frame.as<Wire::Message>();
+            std::string fromId = message.fromId.str();
+            unsigned long seq = message.seq.toNumber();
+            unsigned long long traceId = Tracer::parse(message.seq.data(), message.seq.size());
+            
+            long long startUs = traceId ? Tracer::nowUs() : 0;
+            notifyMessageReceived(fromId, message.message.str());
+            if (traceId) {
+                Tracer::instance().span("client.deliver", traceId, startUs, Tracer::nowUs());
             }
+            
+            // Auto send OK result, batched per peer
+            queueReceipt(fromId, seq, traceId);
+            break;
+        }
+        case OP_RESULT_ACK: {
+            Wire::ResultAck result = frame.as<Wire::ResultAck>();
+            notifyResultReceived(result.fromId.str(), result.status.str());
+            break;
         }
-        else if (command == "RESULT_ACK") { 
-            // RESULT_ACK|fromId|status
-            size_t pos2 = data.find('|');
-            if (pos2 != std::string::npos) {
-                std::string fromId = data.substr(0, pos2);
-                std::string status = data.substr(pos2 + 1);
-                
-                notifyResultReceived(fromId, status);
+        case OP_RESULT_ACK_BATCH: {
+            Wire::ResultAckBatch results = frame.as<Wire::ResultAckBatch>();
+            std::string fromId = results.fromId.str();
+            unsigned long firstSeq = results.firstSeq.toNumber();
+            unsigned long lastSeq = results.lastSeq.toNumber();
+            if (!clampReceipt(fromId, firstSeq, lastSeq)) {
+                break;
             }
+            unsigned long long traceId = Tracer::parse(results.lastSeq.data(), results.lastSeq.size());
+            notifyResultsReceived(fromId, firstSeq, lastSeq, results.status.str());
+            if (traceId) {
+                traceRoundTrip(traceId);
+            }
+            break;
         }
-        else if (command == "CLIENT_LIST") {
-            parseAndNotifyClientList(data);
+        case OP_CLIENT_LIST:
+            parseAndNotifyClientList(frame.as<Wire::ClientList>().entries);
+            break;
+        case OP_CLIENT_LIST_PAGE:
+            parseAndNotifyClientListPage(frame.as<Wire::ClientListPage>());
+            break;
+        case OP_PRESENCE:
+            parseAndNotifyPresence(frame.as<Wire::Presence>().entries);
+            break;
+        case OP_ERROR: {
+            Wire::Error error = frame.as<Wire::Error>();
+            std::string text = error.text.str();
+            unsigned long seq = error.seq.toNumber();
+            if (!error.toId.empty() && seq != 0) {
+                notifyMessageFailed(error.toId.str(), seq, text);
+            }
+            notifyError(text);
+            break;
         }
-        else if (command == "ERROR") {
-            notifyError(data);
+        default:
+            break;
         }
     }
     
-    void parseAndNotifyClientList(const std::string& data) {
+    // Receipts: the server delivers each peer's messages in order, so a gap in
+    // the sequence means the missing messages were never delivered here and
+    // the current run has to be acknowledged on its own.
+    void queueReceipt(const std::string& fromId, unsigned long seq, unsigned long long traceId) {
+        auto it = pendingReceipts.find(fromId);
+        if (it != pendingReceipts.end() && (seq != it->second.lastSeq + 1 || (traceId && it->second.traceId))) {
+            sendReceipt(fromId, it->second);
+            pendingReceipts.erase(it);
+            it = pendingReceipts.end();
+        }
+        
+        if (it == pendingReceipts.end()) {
+            PendingReceipt receipt;
+            receipt.firstSeq = seq;
+            receipt.lastSeq = seq;
+            receipt.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(RECEIPT_DELAY_MS);
+            receipt.traceId = 0;
+            it = pendingReceipts.insert(std::make_pair(fromId, receipt)).first;
+        }
+        
+        it->second.lastSeq = seq;
+        if (traceId) {
+            it->second.traceId = traceId;
+            it->second.tracedAtUs = Tracer::nowUs();
+        }
+    }
+    
+    // Limit a receipt from a peer to the messages sent to it; false if it
+    // covers none of them
+    bool clampReceipt(const std::string& fromId, unsigned long& firstSeq, unsigned long& lastSeq) {
+        OptionalLock lock(socketMutex, !threadless);
+        auto it = sentSeq.find(fromId);
+        if (it == sentSeq.end() || firstSeq == 0 || firstSeq > lastSeq || firstSeq > it->second) {
+            return false;
+        }
+        lastSeq = std::min(lastSeq, it->second);
+        return true;
+    }
+    
+    // Send the receipts that are full or due (all of them if force is set)
+    void flushReceipts(bool force) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (auto it = pendingReceipts.begin(); it != pendingReceipts.end();) {
+            const PendingReceipt& receipt = it->second;
+            if (force || now >= receipt.deadline || receipt.lastSeq - receipt.firstSeq + 1 >= RECEIPT_BATCH_MAX) {
+                sendReceipt(it->first, receipt);
+                it = pendingReceipts.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    
+    void sendReceipt(const std::string& toClientId, const PendingReceipt& receipt) {
+        // RESULT_BATCH|fromId|toId|firstSeq|lastSeq[:traceId]|status
+        std::string lastField = std::to_string(receipt.lastSeq);
+        if (receipt.traceId) {
+            lastField += ":" + Tracer::format(receipt.traceId);
+        }
+        sendToServer(encode<Wire::ResultBatch>(clientId, toClientId, receipt.firstSeq, lastField, "OK"), LANE_RECEIPT);
+        
+        if (receipt.traceId) {
+            Tracer::instance().span("client.receipt_wait", receipt.traceId, receipt.tracedAtUs, Tracer::nowUs());
+        }
+    }
+    
+    // Span from sending a sampled message to receiving its receipt
+    void traceRoundTrip(unsigned long long traceId) {
+        long long startUs;
+        {
+            OptionalLock lock(tracedSendsMutex, !threadless);
+            auto it = tracedSends.find(traceId);
+            if (it == tracedSends.end()) {
+                return;
+            }
+            startUs = it->second;
+            tracedSends.erase(it);
+        }
+        Tracer::instance().span("client.round_trip", traceId, startUs, Tracer::nowUs());
+    }
+    
+    // Milliseconds until the earliest pending receipt is due (-1 if none)
+    int receiptTimeoutMs() const {
+        if (pendingReceipts.empty()) {
+            return -1;
+        }
+        
+        std::chrono::steady_clock::time_point earliest = pendingReceipts.begin()->second.deadline;
+        for (const auto& pair : pendingReceipts) {
+            earliest = std::min(earliest, pair.second.deadline);
+        }
+        
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            earliest - std::chrono::steady_clock::now()).count();
+        return ms < 0 ? 0 : static_cast<int>(ms) + 1;
+    }
+    
+    void parseAndNotifyClientList(StringView entries) {
         std::vector<IChatClientObserver::ClientInfo> clients;
+        parseClientInfos(entries, clients);
         
-        size_t start = 0;
-        size_t pos;
+        std::shared_ptr<const ClientListSnapshot> published;
+        {
+            OptionalLock lock(clientListMutex, !threadless);
+            // A list sent before the server saw our first SUBSCRIBE
+            if (presenceSubscribed) {
+                clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                             [this](const IChatClientObserver::ClientInfo& client) {
+                                                 return presenceWatched.count(client.clientId) == 0;
+                                             }),
+                              clients.end());
+            }
+            published = publishClientList(clients);
+        }
+        notifyClientListUpdated(published->clients);
+    }
+
+    // PRESENCE|id:STATUS|... changes only the listed clients; the others keep
+    // their last known status
+    void parseAndNotifyPresence(StringView entries) {
+        std::vector<IChatClientObserver::ClientInfo> updates;
+        parseClientInfos(entries, updates);
+        
+        std::shared_ptr<const ClientListSnapshot> current;
+        std::shared_ptr<const ClientListSnapshot> published;
+        {
+            OptionalLock lock(clientListMutex, !threadless);
+            current = std::atomic_load(&clientList);
+            std::vector<IChatClientObserver::ClientInfo> clients = current->clients;
+            
+            for (const auto& update : updates) {
+                // The server also watches everyone we message for us
+                if (presenceSubscribed) {
+                    presenceWatched.insert(update.clientId);
+                }
+                auto it = current->index.find(update.clientId);
+                if (it != current->index.end()) {
+                    clients[it->second].isActive = update.isActive;
+                } else {
+                    clients.push_back(update);
+                }
+            }
+            published = publishClientList(clients);
+        }
         
-        while ((pos = data.find('|', start)) != std::string::npos) {
-            std::string clientInfo = data.substr(start, pos - start);
-            parseClientInfo(clientInfo, clients);
-            start = pos + 1;
+        if (published != current) {
+            notifyClientListUpdated(published->clients);
+        }
+    }
+    
+    // SUBSCRIBE/UNSUBSCRIBE sent: from now on the server reports only the
+    // watched clients, so drop every other entry instead of leaving it at a
+    // status that will never be updated again
+    void watchPresence(const std::vector<std::string>& clientIds, bool watch) {
+        std::shared_ptr<const ClientListSnapshot> current;
+        std::shared_ptr<const ClientListSnapshot> published;
+        {
+            OptionalLock lock(clientListMutex, !threadless);
+            presenceSubscribed = true;
+            for (const auto& id : clientIds) {
+                if (watch) {
+                    presenceWatched.insert(id);
+                } else {
+                    presenceWatched.erase(id);
+                }
+            }
+            
+            current = std::atomic_load(&clientList);
+            std::vector<IChatClientObserver::ClientInfo> clients;
+            for (const auto& client : current->clients) {
+                if (presenceWatched.count(client.clientId)) {
+                    clients.push_back(client);
+                }
+            }
+            published = publishClientList(clients);
         }
         
-        // Last item
-        if (start < data.length()) {
-            std::string clientInfo = data.substr(start);
-            parseClientInfo(clientInfo, clients);
+        if (published != current) {
+            notifyClientListUpdated(published->clients);
         }
+    }
     
-        notifyClientListUpdated(clients);
+    // A new registration gets the whole CLIENT_LIST again until it subscribes
+    void resetPresence() {
+        OptionalLock lock(clientListMutex, !threadless);
+        presenceSubscribed = false;
+        presenceWatched.clear();
     }
     
-    void parseClientInfo(const std::string& info, std::vector<IChatClientObserver::ClientInfo>& clients) {
-        size_t colonPos = info.find(':');
-        if (colonPos != std::string::npos) {
-            IChatClientObserver::ClientInfo client;
-            client.clientId = info.substr(0, colonPos);
-            client.isActive = (info.substr(colonPos + 1) == "ACTIVE");
-            clients.push_back(client);
+    // Build a new snapshot from a parsed CLIENT_LIST and publish it if anything
+    // changed (clientListMutex held)
+    std::shared_ptr<const ClientListSnapshot> publishClientList(std::vector<IChatClientObserver::ClientInfo>& clients) {
+        std::shared_ptr<const ClientListSnapshot> current = std::atomic_load(&clientList);
+        
+        bool changed = (clients.size() != current->clients.size());
+        std::shared_ptr<ClientListSnapshot> next = std::make_shared<ClientListSnapshot>();
+        next->version = current->version + 1;
+        next->changedVersion.reserve(clients.size());
+        next->index.reserve(clients.size());
+        
+        for (size_t i = 0; i < clients.size(); ++i) {
+            auto it = current->index.find(clients[i].clientId);
+            if (it != current->index.end() && current->clients[it->second].isActive == clients[i].isActive) {
+                next->changedVersion.push_back(current->changedVersion[it->second]);
+            } else {
+                next->changedVersion.push_back(next->version);
+                changed = true;
+            }
+            next->index[clients[i].clientId] = i;
+        }
+        
+        if (!changed) {
+            return current;
+        }
+        
+        next->clients.swap(clients);
+        std::shared_ptr<const ClientListSnapshot> published = next;
+        std::atomic_store(&clientList, published);
+        return published;
+    }
+    
+    void parseAndNotifyClientListPage(const Wire::ClientListPage& page) {
+        std::vector<IChatClientObserver::ClientInfo> clients;
+        parseClientInfos(page.entries, clients);
+        notifyClientListPage(page.version.toNumber(), page.offset.toNumber(), page.total.toNumber(), clients);
+    }
+    
+    // id:STATUS|id:STATUS|...
+    void parseClientInfos(StringView entries, std::vector<IChatClientObserver::ClientInfo>& clients) {
+        StringView info;
+        for (FieldIterator it(entries); it.next(info);) {
+            size_t colonPos = info.find(':');
+            if (colonPos != StringView::npos) {
+                IChatClientObserver::ClientInfo client;
+                client.clientId = info.substr(0, colonPos).str();
+                client.isActive = (info.substr(colonPos + 1) == "ACTIVE");
+                clients.push_back(client);
+            }
         }
     }
     
     // Observer notifications
     void notifyMessageReceived(const std::string& fromClientId, const std::string& message) {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onMessageReceived(fromClientId, message);
         }
     }
     
     void notifyResultReceived(const std::string& fromClientId, const std::string& result) {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onResultReceived(fromClientId, result);
         }
     }
     
+    void notifyResultsReceived(const std::string& fromClientId, unsigned long firstSeq,
+                               unsigned long lastSeq, const std::string& result) {
+        OptionalLock lock(observersMutex, !threadless);
+        for (auto observer : observers) {
+            observer->onResultsReceived(fromClientId, firstSeq, lastSeq, result);
+        }
+    }
+    
+    void notifyMessageFailed(const std::string& toClientId, unsigned long seq, const std::string& errorMessage) {
+        OptionalLock lock(observersMutex, !threadless);
+        for (auto observer : observers) {
+            observer->onMessageFailed(toClientId, seq, errorMessage);
+        }
+    }
+    
     void notifyConnected() {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onConnected();
         }
     }
     
     void notifyDisconnected() {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onDisconnected();
         }
     }
     
+    void notifyReconnected(bool resumed) {
+        OptionalLock lock(observersMutex, !threadless);
+        for (auto observer : observers) {
+            observer->onReconnected(resumed);
+        }
+    }
+    
     void notifyClientListUpdated(const std::vector<IChatClientObserver::ClientInfo>& clients) {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onClientListUpdated(clients);
         }
     }
     
+    void notifyClientListPage(unsigned long version, size_t offset, size_t total,
+                              const std::vector<IChatClientObserver::ClientInfo>& clients) {
+        OptionalLock lock(observersMutex, !threadless);
+        for (auto observer : observers) {
+            observer->onClientListPage(version, offset, total, clients);
+        }
+    }
+    
     void notifyError(const std::string& errorMessage) {
-        std::lock_guard<std::mutex> lock(observersMutex);
+        OptionalLock lock(observersMutex, !threadless);
         for (auto observer : observers) {
             observer->onError(errorMessage);
         }
@@ -312,7 +1360,11 @@ private:
 
 // Factory method implementation
 IChatClient* createChatClient() {
-    return new ChatClient();
+    return new ChatClient(false);
+}
+
+IPollingChatClient* createPollingChatClient() {
+    return new ChatClient(true);
 }
 
 }
\ No newline at end of file
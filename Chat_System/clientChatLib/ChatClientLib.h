@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <unordered_map>
 
 namespace CHAT_SYSTEM{
 
@@ -17,12 +19,36 @@ public:
     // Callback when a result/acknowledgment is received from another client
     virtual void onResultReceived(const std::string& fromClientId, const std::string& result) = 0;
     
+    // Callback when one receipt covers the messages firstSeq..lastSeq sent to fromClientId
+    // (1 <= firstSeq <= lastSeq <= the last one sent). The default reports each
+    // message through onResultReceived.
+    virtual void onResultsReceived(const std::string& fromClientId, unsigned long firstSeq,
+                                   unsigned long lastSeq, const std::string& result) {
+        for (unsigned long seq = firstSeq; seq <= lastSeq; ++seq) {
+            onResultReceived(fromClientId, result);
+        }
+    }
+    
+    // Callback when the message with this sequence number (as returned by
+    // postMessage) could not be delivered to toClientId. The error is also
+    // reported through onError.
+    virtual void onMessageFailed(const std::string& toClientId, unsigned long seq,
+                                 const std::string& errorMessage) {}
+    
     // Callback when successfully connected
     virtual void onConnected() = 0;
     
     // Callback when disconnected
     virtual void onDisconnected() = 0;
     
+    // Callback when a dropped connection was restored by the library. resumed
+    // is false if the session had expired and the client registered again, in
+    // which case frames sent to it while it was away are lost. Messages posted
+    // while the connection was down are still sent; each message written on
+    // the lost connection that the server never acknowledged is then reported
+    // through onMessageFailed, as it may or may not have arrived.
+    virtual void onReconnected(bool resumed) {}
+    
     // Callback when the client list is received
     struct ClientInfo {
         std::string clientId;
@@ -30,10 +56,41 @@ public:
     };
     virtual void onClientListUpdated(const std::vector<ClientInfo>& clients) = 0;
     
+    // Callback when a page requested with requestClientList() is received.
+    // total is the number of clients matching the prefix on the server.
+    virtual void onClientListPage(unsigned long version, size_t offset, size_t total,
+                                  const std::vector<ClientInfo>& clients) {}
+    
     // Callback when an error occurs
     virtual void onError(const std::string& errorMessage) = 0;
 };
 
+// Immutable view of the client list, published as a whole each time it changes
+struct ClientListSnapshot {
+    // Incremented every time the client list changes (0 until the first CLIENT_LIST)
+    unsigned long version;
+    std::vector<IChatClientObserver::ClientInfo> clients;
+    // Version in which clients[i] was added or last changed status
+    std::vector<unsigned long> changedVersion;
+    // Key: clientId, value: position in clients
+    std::unordered_map<std::string, size_t> index;
+
+    ClientListSnapshot() : version(0) {}
+
+    const IChatClientObserver::ClientInfo* find(const std::string& clientId) const {
+        auto it = index.find(clientId);
+        return it == index.end() ? nullptr : &clients[it->second];
+    }
+};
+
+// Time outbound frames waited in the library's queue for one priority class
+struct OutboundLaneStats {
+    std::string lane;               // "control", "receipts" or "bulk"
+    unsigned long long frames;
+    unsigned long long avgWaitUs;
+    unsigned long long maxWaitUs;
+};
+
 // Client Library Interface
 class IChatClient {
 public:
@@ -45,7 +102,8 @@ public:
     // Unregister an observer
     virtual void unregisterObserver(IChatClientObserver* observer) = 0;
     
-    // Connect to the server
+    // Connect to the server. Client ids must not be empty or contain '|', ':'
+    // or a newline, and no text sent may contain a newline.
     virtual bool connect(const std::string& clientId, const std::string& serverIP, int serverPort) = 0;
     
     // Disconnect from the server
@@ -54,24 +112,80 @@ public:
     // Send a message to another client
     virtual bool sendMessage(const std::string& toClientId, const std::string& message) = 0;
     
+    // Send a message and return its sequence number towards toClientId (0 on failure).
+    // The receipt for it is reported through onResultsReceived.
+    virtual unsigned long postMessage(const std::string& toClientId, const std::string& message) = 0;
+    
     // Send a result/acknowledgment
     virtual bool sendResult(const std::string& toClientId, const std::string& result) = 0;
     
+    // Ask the server for one page of the client list (limit 0 = server maximum).
+    // The answer is delivered through onClientListPage.
+    virtual bool requestClientList(const std::string& prefix, size_t offset, size_t limit) = 0;
+    
+    // Hear only about these clients, and about every client this one messages,
+    // instead of receiving the whole client list on each change. The first call
+    // switches the session over (an empty list watches nobody yet); the current
+    // status of each new client arrives through onClientListUpdated. From then
+    // on the client list (getListClientId, isClientActive, the snapshot) holds
+    // only the watched clients; the rest are dropped since their status would
+    // no longer be updated. A new session after a failed resume goes back to
+    // the whole list until this is called again.
+    virtual bool subscribePresence(const std::vector<std::string>& clientIds) = 0;
+    
+    // Stop watching these clients and drop them from the client list
+    virtual bool unsubscribePresence(const std::vector<std::string>& clientIds) = 0;
+    
     // Check the connection status
     virtual bool isConnected() const = 0;
     
     // Get the client ID
     virtual std::string getClientId() const = 0;
+    
+    // Outbound queue latency per priority class (control, receipts, bulk)
+    virtual std::vector<OutboundLaneStats> getOutboundStats() const = 0;
+
+    // Get the latest client list snapshot (never null, safe to call from any thread)
+    virtual std::shared_ptr<const ClientListSnapshot> getClientListSnapshot() const = 0;
 
     //get list client id
-    std::vector<IChatClientObserver::ClientInfo>  getListClientId() const;
-private:
-    std::vector<IChatClientObserver::ClientInfo> clients;
+    virtual std::vector<IChatClientObserver::ClientInfo> getListClientId() const = 0;
+
+    // Check whether a client is ACTIVE in the latest client list
+    virtual bool isClientActive(const std::string& clientId) const = 0;
+
+    // Get the clients added or changed after the given client list version
+    virtual std::vector<IChatClientObserver::ClientInfo> getClientListChangesSince(unsigned long version) const = 0;
+};
+
+// Client driven by the caller's event loop (poll, epoll, ...). It never starts a
+// thread and takes no locks, so every call must come from the loop's thread.
+class IPollingChatClient : public IChatClient {
+public:
+    // Socket to watch (-1 when not connected)
+    virtual int getFd() const = 0;
+    
+    // Events to wait for: POLLIN, plus POLLOUT while connecting or while output
+    // is queued (same values as EPOLLIN / EPOLLOUT)
+    virtual short getWantedEvents() const = 0;
+    
+    // Call when the socket is ready: completes the connect, writes queued
+    // output, reads and dispatches incoming frames to the observers
+    virtual void processIO() = 0;
+    
+    // Milliseconds until onTimer() is due (-1 if no timer is pending)
+    virtual int getTimeoutMs() const = 0;
+    
+    // Call when the timeout expires
+    virtual void onTimer() = 0;
 };
 
 // Factory method to create an instance of ChatClient
 IChatClient* createChatClient();
 
+// Factory method to create a ChatClient driven by an external event loop
+IPollingChatClient* createPollingChatClient();
+
 }
 
 #endif // CHAT_CLIENT_LIB_H